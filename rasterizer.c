@@ -1,17 +1,41 @@
+#ifndef HEADLESS
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#endif
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
 #include <math.h>
+#include <omp.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define color_max 1000
-#define canvas_width 1920
-#define canvas_height 1080
-#define viewport_width 1.0
-#define viewport_height 0.56
+#define default_width 1920
+#define default_height 1080
+#define max_scenes 8
+#define default_viewport_width 1.0
 #define canvas_depth 1.0
-
+#define near_plane 0.01
+#define subpixel_bits 4
+#define subpixel_scale (1 << subpixel_bits)
+#define tile_size 64
+#define depth_block 8
+#define max_lights 8
+#define specular_table_size 256
+#define max_texture_levels 16
+
+#ifndef HEADLESS
 void window_size_callback(GLFWwindow * window, int width, int height) {
 	glViewport(0, 0, width, height);
 }
@@ -22,13 +46,13 @@ void handle_close(GLFWwindow * window) {
 	}
 }
 
-GLFWwindow * opengl_init(unsigned int * VAO, unsigned int * program, unsigned int * texture) {
+GLFWwindow * opengl_init(int width, int height, unsigned int * VAO, unsigned int * program, unsigned int * texture) {
 	glfwInit();
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-	GLFWwindow * window = glfwCreateWindow(1920, 1080, "Canvas", NULL, NULL);
+	GLFWwindow * window = glfwCreateWindow(width, height, "Canvas", NULL, NULL);
 	glfwMakeContextCurrent(window);
 	glfwSetFramebufferSizeCallback(window, window_size_callback);
 	glfwPollEvents();
@@ -36,7 +60,7 @@ GLFWwindow * opengl_init(unsigned int * VAO, unsigned int * program, unsigned in
 	glewExperimental = GL_TRUE;
 	glewInit();
 
-	glViewport(0,0, 1920, 1080);
+	glViewport(0,0, width, height);
 	
 	float verts [] = {
 		-1.0, -1.0,0,0,
@@ -110,12 +134,45 @@ GLFWwindow * opengl_init(unsigned int * VAO, unsigned int * program, unsigned in
 
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
 	return window;
 }
+#endif
+
+//the depth buffer holds 1/view z, which is linear in screen space and so interpolates
+//exactly across a triangle. nearer is larger and 0 is the cleared value. it is stored as
+//a float, or built with -DDEPTH_FIXED24 as a 24 bit fraction of 1/near_plane in a uint32
+#ifdef DEPTH_FIXED24
+typedef unsigned int depth_value;
+#define depth_format "fixed24"
+#define depth_fixed_scale (near_plane*16777215.0)
+#else
+typedef float depth_value;
+#define depth_format "float32"
+#endif
+_Static_assert(sizeof(depth_value) == 4, "the depth buffer is cleared as 32 bit words");
+
+depth_value depth_encode(double inv_z) {
+#ifdef DEPTH_FIXED24
+	double fixed = inv_z*depth_fixed_scale;
+	return fixed < 16777215.0 ? (depth_value)fixed : 16777215;
+#else
+	return (depth_value)inv_z;
+#endif
+}
+
+double depth_decode(depth_value depth) {
+#ifdef DEPTH_FIXED24
+	return depth/depth_fixed_scale;
+#else
+	return depth;
+#endif
+}
 
+//x and y are measured from the centre of the screen in 28.4 fixed point, sixteenths of a
+//pixel, so edges keep their sub-pixel position. z is the view space depth
 typedef struct canvas_point {
 	int x; 
 	int y;
@@ -131,16 +188,157 @@ typedef struct rgb_color {
 typedef struct int_arena {
 	int n_items;
 	int max_items;
+	int high_water;
+	int n_grows;
 	int * storage;
 } int_arena;
 
+typedef struct coord {
+	double x;
+	double y;
+	double z;
+	double w;
+} coord;
+
+typedef struct matrix {
+	coord a;
+	coord b;
+	coord c;
+	coord d;
+} matrix;
+
+//seconds spent in each stage of the pipeline, summed over the frames drawn while a scene
+//points at it. triangles and pixels count what reached setup and the area they cover
+typedef struct frame_stats {
+	double clear;
+	double transform;
+	double lighting;
+	double setup;
+	double fill;
+	double resolve;
+	double present;
+	long long triangles;
+	long long pixels;
+} frame_stats;
+
+//lights are given in view space, so they move with the camera
+enum {light_directional, light_point};
+
+//shade_vertex lights vertices and interpolates the intensity. shade_pixel interpolates
+//normals and lights every pixel as it is drawn. shade_deferred draws colour and normal
+//only, and scene_end_frame lights each visible pixel once whatever the overdraw was
+enum {shade_vertex, shade_pixel, shade_deferred};
+
+typedef struct light {
+	int type;
+	//the unit vector towards a directional light, or where a point light is
+	coord vector;
+	double intensity;
+} light;
+
+//the lights and the one phong material everything is lit with. specular_table holds
+//cos^shininess sampled over [0, 1], which stands in for pow when lighting
+typedef struct light_rig {
+	light lights[max_lights];
+	int n_lights;
+	double ambient;
+	double diffuse;
+	double specular;
+	int shininess;
+	float specular_table[specular_table_size + 1];
+
+	//one of shade_vertex, shade_pixel or shade_deferred
+	int shading;
+} light_rig;
+
+//textures are power of two sized rgba images with a full mip chain. every level is
+//stored in morton order, x and y bits interleaved, so texels near each other in both
+//directions are near each other in memory. texel 0, 0 is the bottom left corner
+enum {filter_nearest, filter_bilinear, filter_trilinear};
+
+typedef struct texture_level {
+	int log_width;
+	int log_height;
+	unsigned int * texels;
+} texture_level;
+
+typedef struct texture {
+	int width;
+	int height;
+	int n_levels;
+	int filter;
+	texture_level levels[max_texture_levels];
+	unsigned int * storage;
+} texture;
+
 typedef struct scene {
-	unsigned char * screen; 
-	double *depth_buffer;
+	//one 32 bit word per pixel holding r, g, b, a bytes in memory order, bottom row first
+	//like the gl texture it is uploaded to. 64 byte aligned, as is the depth buffer
+	unsigned int * screen; 
+	depth_value * depth_buffer;
+
+	//with deferred shading screen holds each pixel's unlit colour and this its view space
+	//normal, octahedral packed. together with the depth buffer they are the g-buffer
+	unsigned int * normal_buffer;
+
+	//the smallest 1/z stored in each depth_block square of the screen, or less.
+	//being conservative it can reject work whatever order pixels are written in
+	double * coarse_depth;
+	int coarse_width;
 	int screen_width; 
 	int screen_height; 
-	int_arena * scene_arena;
 
+	//size of the viewport on the projection plane at canvas_depth. its aspect matches the
+	//screen so pixels are square
+	double viewport_width;
+	double viewport_height;
+	int_arena * scene_arena;
+	int n_threads;
+	struct triangle_buffer * triangle_storage;
+	struct vertex_buffer * vertex_storage;
+	struct vertex_stream * view_stream;
+	struct vertex_stream * clip_stream;
+	struct vertex_stream * screen_stream;
+	struct triangle_buffer * clipped_storage;
+	struct setup_buffer * setup_storage;
+	struct line_buffer * line_storage;
+	struct instance_buffer * instance_storage;
+	frame_stats * stats;
+	light_rig * lights;
+
+	//the texture of the current draw, or NULL. draws without texture coordinates ignore it
+	const texture * texture;
+
+	//which faces are dropped before lighting, one of cull_none, cull_back or cull_front
+	int cull;
+
+	//edges the demo draws over meshes: wireframe_none, wireframe_hard or wireframe_smooth
+	int wireframe;
+
+	//for checking the rasterizer. with reference_fill every triangle is filled pixel by
+	//pixel with the scalar kernels, skipping the coarse depth tests, and with coverage set
+	//nothing is drawn but each pixel's word there counts the triangles covering it
+	int reference_fill;
+	unsigned int * coverage;
+
+	//multisampling. with samples at 4 or 8 each pixel keeps that many depths and colours,
+	//and normals for deferred shading, stored together pixel by pixel. the fill writes
+	//those instead of the screen and scene_end_frame resolves them into the screen and
+	//depth buffer. at 1 there are no sample buffers
+	int samples;
+	unsigned int * sample_color;
+	depth_value * sample_depth;
+	unsigned int * sample_normal;
+
+	//camera: world to view space, and view space to clip space with the viewport folded in
+	matrix view;
+	matrix projection;
+
+	//screen space rectangle that drawing is restricted to, set to a single tile when binning
+	int clip_x0;
+	int clip_y0;
+	int clip_x1;
+	int clip_y1;
 } scene;
 
 canvas_point create_point(int x, int y, double z) {
@@ -148,29 +346,21 @@ canvas_point create_point(int x, int y, double z) {
 	return new;
 }
 
+//a canvas coordinate in pixels to the nearest sixteenth
+int canvas_snap(double v) {
+	return (int)floor(v*subpixel_scale + 0.5);
+}
+
 rgb_color create_color(unsigned char r, unsigned char g, unsigned char b) {
 	rgb_color new = {r, g, b};
 	return new;
 }
 
-void put_pixel_on_screen(scene s, int x, int y, rgb_color color, double z) {
-	//printf("Drawing.");
-	assert((x < s.screen_width) && (x >= 0));
-	assert((y < s.screen_height) && (y >= 0));
-
-	//lt may be wrong here
-	if (s.depth_buffer[x+s.screen_width*y] < (1/z)) {  
-		s.screen[(x+s.screen_width*y)*3] = color.r;
-		s.screen[(x+s.screen_width*y)*3 + 1] = color.g;
-		s.screen[(x+s.screen_width*y)*3 + 2] = color.b;
-
-		s.depth_buffer[x+s.screen_width*y] = (1/z);  
-	}
-
-}
-
-void put_pixels_on_canvas(scene s, canvas_point point, rgb_color color) {
-	put_pixel_on_screen(s, point.x + (s.screen_width/2), point.y + (s.screen_height/2), color, point.z);
+unsigned int pixel_pack(rgb_color color) {
+	unsigned char bytes[4] = {color.r, color.g, color.b, 255};
+	unsigned int pixel;
+	memcpy(&pixel, bytes, 4);
+	return pixel;
 }
 
 int_arena * int_arena_create (int size) {
@@ -178,6 +368,8 @@ int_arena * int_arena_create (int size) {
 	arena->storage = calloc(size, sizeof(int));
 	arena->max_items = size;
 	arena->n_items = 0;
+	arena->high_water = 0;
+	arena->n_grows = 0;
 	return arena;
 }
 
@@ -186,125 +378,77 @@ void int_arena_free(int_arena * arena) {
 	free(arena);
 } 
 
-void int_arena_add(int_arena * arena, int a) {
-	if (arena->n_items >= arena->max_items-1) {
+//makes room for n more items. this is the only place the storage can move, so pointers
+//into the arena stay valid until the next reserve that actually has to grow
+void int_arena_reserve(int_arena * arena, int n) {
+	if (arena->n_items + n < arena->max_items) {
+		return;
+	}
+	while (arena->n_items + n >= arena->max_items) {
 		arena->max_items *= 2;
-		arena->storage = realloc(arena->storage, arena->max_items*sizeof(int));
-		//printf("Realloc occured\n");
 	}
-	arena->storage[arena->n_items] = a;
-	arena->n_items++;
-}
-
-typedef struct int_array {
-	int n_integers;
-	int offset;
-	struct int_arena * arena;
-} int_array;
-
-int_array int_array_create(int_arena * arena) {
-	int_array new_array = {0,arena->n_items, arena};	
-	return new_array;
-}
-
-void int_array_append(int_array *array, int value) {
-	int_arena_add(array->arena, value);
-	array->n_integers ++;
+	arena->storage = realloc(arena->storage, arena->max_items*sizeof(int));
+	arena->n_grows++;
+	//printf("Realloc occured\n");
 }
 
-int int_array_get_index(int_array array, int index) {
-	return array.arena->storage[array.offset + index];
+int * int_arena_alloc(int_arena * arena, int n) {
+	int_arena_reserve(arena, n);
+	int * items = &arena->storage[arena->n_items];
+	arena->n_items += n;
+	if (arena->n_items > arena->high_water) {
+		arena->high_water = arena->n_items;
+	}
+	return items;
 }
 
-void int_array_drop_last(int_array * array) {
-	array->n_integers -= 1;
+int int_arena_mark(int_arena * arena) {
+	return arena->n_items;
 }
 
-int_array interpolate(scene s, int i0, int d0, int i1, int d1) {
-	int_array new_array = int_array_create(s.scene_arena);
-	if (i0 == i1) {
-		int_array_append(&new_array, d0);
-		return new_array;
-	}
-	double a = ((double)(d1-d0))/((double)(i1 - i0));
-	double d = d0;
-	for (int i = i0; i < i1; i ++) {
-		int_array_append(&new_array, (int)d);
-		d = d+a;
-	}
-	return new_array;
+void int_arena_rewind(int_arena * arena, int mark) {
+	assert(mark >= 0 && mark <= arena->n_items);
+	arena->n_items = mark;
 }
 
-int_array arena_drop_element(scene s, int_array a){
-	int_array output = a;
-	output.n_integers -= 1;
-	s.scene_arena->n_items -= 1;
-	return output;
+void int_arena_reset(int_arena * arena) {
+	arena->n_items = 0;
 }
 
-void int_array_print(int_array input) {
-	for (int i = input.offset; i < input.offset + input.n_integers; i ++) {
-		printf("%d,", input.arena->storage[i]);
-	}
-	printf("\n");
+void int_arena_print_stats(const char * name, int_arena * arena) {
+	fprintf(stderr, "%s: %d of %d ints used, high water %d, grew %d times\n", name, arena->n_items, arena->max_items, arena->high_water, arena->n_grows);
 }
 
-void drawline(scene s, canvas_point p0, canvas_point p1, rgb_color color) {
-	assert((p0.x >= (-s.screen_width/2)) && (p0.x < (s.screen_width/2)));
-	assert((p1.x >= (-s.screen_width/2)) && (p1.x < (s.screen_width/2)));
-	assert((p0.y >= (-s.screen_height/2)) && (p0.y < (s.screen_height/2)));
-	assert((p1.y >= (-s.screen_height/2)) && (p1.y < (s.screen_height/2)));
-
-	int_array draw_array; 
-
-	if (abs(p1.x - p0.x) > abs(p1.y - p0.y)) {
-		if (p0.x > p1.x) {
-			canvas_point temp = p0;
-			p0 = p1;
-			p1 = temp;
-		}
-		draw_array = interpolate(s, p0.x, p0.y, p1.x, p1.y);
-		for (int x = p0.x; x < p1.x; x++) {
-			put_pixels_on_canvas(s, create_point(x,int_array_get_index(draw_array,x-p0.x), 0.0), color); //this needs to interpolate z 
-		}
-	} else {
-		if (p0.y > p1.y) {
-			canvas_point temp = p0;
-			p0 = p1;
-			p1 = temp;
-		}
-		draw_array = interpolate(s,p0.y, p0.x, p1.y, p1.x);
-		for (int y = p0.y; y < p1.y; y++) {
-			put_pixels_on_canvas(s, create_point(int_array_get_index(draw_array, y-p0.y), y, 0.0), color); //this needs to interpolate z
-		}
-	}
+typedef struct packed_normal {
+	float x;
+	float y;
+	float z;
+} packed_normal;
 
-}
+typedef struct texture_coord {
+	float u;
+	float v;
+} texture_coord;
 
 typedef struct triangle {
 	canvas_point p1;	
 	canvas_point p2;	
 	canvas_point p3;	
 	rgb_color color;
-	rgb_color outline_color;
 	int p1l;
 	int p2l;
 	int p3l;
-} triangle; 
 
-typedef struct coord {
-	double x;
-	double y;
-	double z;
-	double w;
-} coord;
+	//view space unit normals at the corners, used by per pixel lighting
+	packed_normal n1;
+	packed_normal n2;
+	packed_normal n3;
 
-typedef struct matrix {
-	coord a;
-	coord b;
-	coord c;
-	coord d;
-} matrix;
+	//texture coordinates at the corners, used when the scene has a texture
+	texture_coord uv1;
+	texture_coord uv2;
+	texture_coord uv3;
+} triangle; 
 
 int coord_equal(coord a, coord b) {
 	if (a.x == b.x && a.y == b.y && a.z == b.z && a.w == b.w) {
@@ -328,7 +472,7 @@ coord coord_scale(coord input, double scale) {
 } 
 
 double coord_dot(coord a, coord b) {
-	double output = a.x*b.x + a.y*b.y + a.z*b.z + a.w + b.w;
+	double output = a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w;
 	return output;
 } 
 
@@ -355,6 +499,18 @@ double coord_length(coord a) {
 	return output;
 }
 
+coord coord_unit(coord intput_coord) {
+	double len = coord_length(intput_coord);
+	coord output = coord_scale(intput_coord, 1/len);
+	return output;
+}
+
+coord coord_cross(coord a,coord b) {
+	coord output = {a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x, 0.0};
+	output = coord_unit(output);
+	return output;
+}
+
 coord coord_to_viewport(coord a) {
 	double x = (a.x*canvas_depth)/a.z;
 	double y = (a.y*canvas_depth)/a.z;
@@ -362,10 +518,10 @@ coord coord_to_viewport(coord a) {
 	return result;
 }
 
-canvas_point coord_to_canvas(coord coordinate) {
-	int x_coord = (int)(coordinate.x*(((double)canvas_width)/viewport_width));
-	int y_coord = (int)(coordinate.y*(((double)canvas_height)/viewport_height));
-	canvas_point result = {x_coord,y_coord};
+canvas_point coord_to_canvas(scene s, coord coordinate) {
+	int x_coord = canvas_snap(coordinate.x*(((double)s.screen_width)/s.viewport_width));
+	int y_coord = canvas_snap(coordinate.y*(((double)s.screen_height)/s.viewport_height));
+	canvas_point result = {x_coord,y_coord, coordinate.z};
 	return result;
 }
 
@@ -383,9 +539,14 @@ matrix matrix_scale(matrix m, double s) {
 	return result;
 }
 
+//the coords of a matrix are its columns, so m*v is the columns weighted by the entries of v
 coord matrix_vector_mul(matrix m, coord v) {
-	matrix temp = matrix_fip(m);
-	coord result = {coord_dot(temp.a, v), coord_dot(temp.b, v), coord_dot(temp.c, v), coord_dot(temp.d, v)};
+	coord result = {
+		m.a.x*v.x + m.b.x*v.y + m.c.x*v.z + m.d.x*v.w,
+		m.a.y*v.x + m.b.y*v.y + m.c.y*v.z + m.d.y*v.w,
+		m.a.z*v.x + m.b.z*v.y + m.c.z*v.z + m.d.z*v.w,
+		m.a.w*v.x + m.b.w*v.y + m.c.w*v.z + m.d.w*v.w,
+	};
 	return result;
 }
 
@@ -397,28 +558,89 @@ matrix matrix_normalize(matrix m) {
 	return matrix_scale(m, (1/val));
 }
 
+//m*b, applying b first. each column of the result is m times the matching column of b
 matrix matrix_matrix_mul(matrix m, matrix b) {
-	matrix a = matrix_fip(m);
-	matrix result;
-	//ugh
+	matrix result = {matrix_vector_mul(m, b.a), matrix_vector_mul(m, b.b), matrix_vector_mul(m, b.c), matrix_vector_mul(m, b.d)};
+	return result;
+}
+
+//the cofactors of m's upper 3x3 part, which take the cross product of two vectors to the
+//cross product of the vectors transformed by m. it carries face normals through any
+//transform, length and all, without the inverse
+matrix matrix_cofactor(matrix m) {
+	matrix result = {
+		coord_create(m.b.y*m.c.z - m.b.z*m.c.y, m.b.z*m.c.x - m.b.x*m.c.z, m.b.x*m.c.y - m.b.y*m.c.x, 0.0),
+		coord_create(m.c.y*m.a.z - m.c.z*m.a.y, m.c.z*m.a.x - m.c.x*m.a.z, m.c.x*m.a.y - m.c.y*m.a.x, 0.0),
+		coord_create(m.a.y*m.b.z - m.a.z*m.b.y, m.a.z*m.b.x - m.a.x*m.b.z, m.a.x*m.b.y - m.a.y*m.b.x, 0.0),
+		coord_create(0.0, 0.0, 0.0, 1.0),
+	};
+	return result;
+}
+
+matrix matrix_identity() {
+	matrix result = {
+		coord_create(1.0, 0.0, 0.0, 0.0),
+		coord_create(0.0, 1.0, 0.0, 0.0),
+		coord_create(0.0, 0.0, 1.0, 0.0),
+		coord_create(0.0, 0.0, 0.0, 1.0),
+	};
+	return result;
+}
+
+matrix matrix_translate(double x, double y, double z) {
+	matrix result = matrix_identity();
+	result.d = coord_create(x, y, z, 1.0);
+	return result;
+}
+
+matrix matrix_scaling(double x, double y, double z) {
+	matrix result = matrix_identity();
+	result.a.x = x;
+	result.b.y = y;
+	result.c.z = z;
+	return result;
+}
+
+matrix matrix_rotate_x(double angle) {
+	matrix result = matrix_identity();
+	result.b = coord_create(0.0, cos(angle), sin(angle), 0.0);
+	result.c = coord_create(0.0, -sin(angle), cos(angle), 0.0);
+	return result;
+}
+
+matrix matrix_rotate_y(double angle) {
+	matrix result = matrix_identity();
+	result.a = coord_create(cos(angle), 0.0, -sin(angle), 0.0);
+	result.c = coord_create(sin(angle), 0.0, cos(angle), 0.0);
 	return result;
 }
 
-int_array int_array_cat(int_array a, int_array b) {
-	assert(a.arena == b.arena);
-	assert(a.offset + a.n_integers == b.offset);
-	int_array result;
-	result.offset = a.offset; 
-	result.arena = a.arena;
-	result.n_integers =  a.n_integers + b.n_integers;
+//view matrix for a camera at eye looking at target. view space keeps the convention of
+//the rest of the rasterizer: x right, y up and the camera looking down +z
+matrix matrix_look_at(coord eye, coord target, coord up) {
+	coord forward = coord_unit(coord_sub(target, eye));
+	coord right = coord_cross(up, forward);
+	coord true_up = coord_cross(forward, right);
+	forward.w = 0.0;
+	matrix result = {
+		coord_create(right.x, true_up.x, forward.x, 0.0),
+		coord_create(right.y, true_up.y, forward.y, 0.0),
+		coord_create(right.z, true_up.z, forward.z, 0.0),
+		coord_create(-(right.x*eye.x + right.y*eye.y + right.z*eye.z), -(true_up.x*eye.x + true_up.y*eye.y + true_up.z*eye.z), -(forward.x*eye.x + forward.y*eye.y + forward.z*eye.z), 1.0),
+	};
 	return result;
 }
 
-void draw_triangle_outline(scene s, triangle t) {
-	//outline
-	drawline(s, t.p1, t.p2, t.outline_color);
-	drawline(s, t.p1, t.p3, t.outline_color);
-	drawline(s, t.p2, t.p3, t.outline_color);
+//perspective projection straight to canvas pixels. after the divide x and y are canvas
+//coordinates, z runs from 0 at the near plane towards 1 at infinity and w holds 1/view z
+matrix matrix_perspective(double depth, double viewport_w, double viewport_h, int canvas_w, int canvas_h, double near) {
+	matrix result = {
+		coord_create(depth*canvas_w/viewport_w, 0.0, 0.0, 0.0),
+		coord_create(0.0, depth*canvas_h/viewport_h, 0.0, 0.0),
+		coord_create(0.0, 0.0, 1.0, 1.0),
+		coord_create(0.0, 0.0, -near, 0.0),
+	};
+	return result;
 }
 
 rgb_color color_scale(rgb_color base_color, int scale) {
@@ -429,420 +651,5079 @@ rgb_color color_scale(rgb_color base_color, int scale) {
 	return result;
 }
 
-void draw_triangle_interior(scene s, triangle t, int h1, int h2, int h3) {
-	assert(h1 < color_max && h2 < color_max && h3 < color_max);
-	assert(t.p1.y<= t.p2.y);
-	assert(t.p2.y <= t.p3.y);
-
-	//x points
-	int_array x01 = interpolate(s, t.p1.y, t.p1.x, t.p2.y, t.p2.x);	
-	int_array x12 = interpolate(s, t.p2.y, t.p2.x, t.p3.y, t.p3.x);	
-	int_array x012 = int_array_cat(x01, x12);
-	int_array x02 = interpolate(s, t.p1.y, t.p1.x, t.p3.y, t.p3.x);	
-	
-	int_array z01 = interpolate(s, t.p1.y, (int)(t.p1.z*1000), t.p2.y, (int)(t.p2.z*1000));	
-	int_array z12 = interpolate(s, t.p2.y, (int)(t.p2.z*1000), t.p3.y, (int)(t.p3.z*1000));	
-	int_array z012 = int_array_cat(z01, z12);
-	int_array z02 = interpolate(s, t.p1.y, (int)(t.p1.z*1000), t.p3.y, (int)(t.p3.z*1000));	
-
-	//h points note, mixing these in with x point computations will lead to disaster
-	int_array h01	= interpolate(s, t.p1.y, h1, t.p2.y, h2);
-	int_array h12	= interpolate(s, t.p2.y, h2, t.p3.y, h3);
-	int_array h012 = int_array_cat(h01, h12);
-	int_array h02 = interpolate(s, t.p1.y, h1, t.p3.y, h3);	
-
-	//determine which item is left 
-	int_array x_left = x012;
-	int_array x_right = x02;
-	
-	int_array z_left = z012;
-	int_array z_right = z02;
+//a shared edge is walked in opposite directions by the two triangles using it,
+//so exactly one of them counts it as top-left and owns the pixels lying on it
+int edge_is_top_left(canvas_point a, canvas_point b) {
+	int dx = b.x - a.x;
+	int dy = b.y - a.y;
+	return (dy < 0) || (dy == 0 && dx > 0);
+}
 
-	int_array h_left = h012;
-	int_array h_right = h02;
+void light_rig_set_shininess(light_rig * rig, int shininess) {
+	rig->shininess = shininess;
+	for (int i = 0; i <= specular_table_size; i++) {
+		rig->specular_table[i] = (float)pow((double)i/specular_table_size, shininess);
+	}
+}
 
-	int m = (int)floor(((double)x012.n_integers)/2.0);
-	if (int_array_get_index(x02,m) < int_array_get_index(x012,m)) {
-		x_left = x02;
-		x_right = x012;
+//adds a light, directional ones given by the way their light travels. returns -1 when
+//the rig is full
+int light_rig_add(light_rig * rig, int type, coord vector, double intensity) {
+	if (rig->n_lights == max_lights) {
+		return -1;
+	}
+	light * l = &rig->lights[rig->n_lights++];
+	l->type = type;
+	l->vector = type == light_directional ? coord_scale(coord_unit(vector), -1.0) : vector;
+	l->vector.w = 0;
+	l->intensity = intensity;
+	return 0;
+}
 
-		h_left = h02;
-		h_right = h012;
+//one white light shining in over the viewer's right shoulder
+void light_rig_init(light_rig * rig) {
+	rig->n_lights = 0;
+	rig->ambient = 0.2;
+	rig->diffuse = 0.4;
+	rig->specular = 0.4;
+	rig->shading = shade_vertex;
+	light_rig_set_shininess(rig, 11);
+	light_rig_add(rig, light_directional, coord_create(-0.4, -0.4, 1.0, 0.0), 1.0);
+}
 
-		z_left = z02;
-		z_right = z012;
+double specular_lookup(const light_rig * rig, double c) {
+	double f = c*specular_table_size;
+	int i = (int)f;
+	if (i >= specular_table_size) {
+		return rig->specular_table[specular_table_size];
 	}
+	return rig->specular_table[i] + (f - i)*(rig->specular_table[i+1] - rig->specular_table[i]);
+}
 
-	for (int y = t.p1.y; y < t.p3.y; y++) {
-		int xl = int_array_get_index(x_left, y-t.p1.y);
-		int xr = int_array_get_index(x_right, y-t.p1.y);
+//phong lighting of a view space point with unit normal, between 0 and 1. faces turned
+//away from the viewer are lit from their other side, so unculled back faces are not black
+double light_intensity(const light_rig * rig, coord position, coord normal) {
+	position.w = 0;
+	normal.w = 0;
+	coord to_eye = coord_unit(coord_scale(position, -1.0));
+	if (coord_dot(normal, to_eye) < 0) {
+		normal = coord_scale(normal, -1.0);
+	}
 
-		int hl = int_array_get_index(h_left, y-t.p1.y);
-		int hr = int_array_get_index(h_right, y-t.p1.y);
-		
-		int zl = int_array_get_index(z_left, y-t.p1.y);
-		int zr = int_array_get_index(z_right, y-t.p1.y);
+	double intensity = rig->ambient;
+	for (int i = 0; i < rig->n_lights; i++) {
+		const light * l = &rig->lights[i];
+		coord to_light = l->type == light_directional ? l->vector : coord_unit(coord_sub(l->vector, position));
+		double diffuse = coord_dot(normal, to_light);
+		if (diffuse <= 0) {
+			continue;
+		}
+		coord reflected = coord_sub(coord_scale(normal, 2*diffuse), to_light);
+		double specular = coord_dot(reflected, to_eye);
+		intensity += l->intensity*rig->diffuse*diffuse;
+		if (specular > 0) {
+			intensity += l->intensity*rig->specular*specular_lookup(rig, specular);
+		}
+	}
+	return intensity < 1.0 ? intensity : 1.0;
+}
 
-		int_array h_segment = interpolate(s, xl, hl, xr, hr);
-		int_array z_segment = interpolate(s, xl, zl, xr, zr);
+//light_intensity as the integer intensity triangles carry
+int get_lighting(const light_rig * rig, coord position, coord normal) {
+	int intensity = (int)(light_intensity(rig, position, normal)*color_max);
+	return intensity < color_max ? intensity : color_max - 1;
+}
 
-		for (int x = xl; x < xr; x++) {
-			rgb_color shaded_color = color_scale(t.color,int_array_get_index(h_segment, x-xl)); 
-			double z = (double)(int_array_get_index(z_segment, x-xl));
-			put_pixels_on_canvas(s, create_point(x,y,z), shaded_color);
-		}
-	}	
+packed_normal normal_pack(coord normal) {
+	packed_normal packed = {(float)normal.x, (float)normal.y, (float)normal.z};
+	return packed;
 }
 
-void draw_triangle(scene s, triangle t) {
-	draw_triangle_interior(s, t, t.p1l, t.p2l, t.p3l);
-	//draw_triangle_interior(s, t, 10, 500, 990);
-	//draw_triangle_outline(s,t);
+//the view space point seen through the centre of screen pixel x, y at depth 1/w
+coord pixel_view_position(const scene * s, int x, int y, double w) {
+	double z = 1/w;
+	double x_scale = s->viewport_width/(s->screen_width*canvas_depth);
+	double y_scale = s->viewport_height/(s->screen_height*canvas_depth);
+	return coord_create((x - s->screen_width/2 + 0.5)*x_scale*z, (y - s->screen_height/2 + 0.5)*y_scale*z, z, 0.0);
 }
 
-triangle triangle_create (int x1, int y1, double z1,int x2, int y2, double z2, int x3, int y3, double z3, unsigned char r, unsigned char g, unsigned char b, unsigned char r2, unsigned char g2, unsigned char b2) {
-	canvas_point p1 = create_point(x1,y1, z1);
-	canvas_point p2 = create_point(x2,y2, z2);
-	canvas_point p3 = create_point(x3,y3, z3);
-	canvas_point temp;
+//a direction of any length folded onto the octahedron |x| + |y| + |z| = 1 and flattened,
+//stored as two 16 bit fractions. the lower half folds out over the corners, all four of
+//which are straight down -z. the one at 0 is kept for a zero normal, lit with the ambient
+//light alone as pixel_light does, and directions rounding to it take the opposite corner
+#define normal_none 0u
 
-	if (p1.y > p2.y) {
-		temp = p1; 
-		p1 = p2;
-		p2 = temp;
-	}
-	
-	if (p2.y > p3.y) {
-		temp = p2; 
-		p2 = p3;
-		p3 = temp;
+unsigned int normal_encode(double x, double y, double z) {
+	double l1 = fabs(x) + fabs(y) + fabs(z);
+	if (l1 == 0) {
+		return normal_none;
 	}
-	
-	if (p1.y > p2.y) {
-		temp = p1; 
-		p1 = p2;
-		p2 = temp;
+	double u = x/l1;
+	double v = y/l1;
+	if (z < 0) {
+		double fu = (1 - fabs(v))*(u < 0 ? -1 : 1);
+		double fv = (1 - fabs(u))*(v < 0 ? -1 : 1);
+		u = fu;
+		v = fv;
 	}
-
-	triangle new_triangle = {p1,p2,p3,create_color(r,g,b), create_color(r2,g2,b2)};
-	return new_triangle;
+	unsigned int iu = (unsigned int)((u*0.5 + 0.5)*65535.0 + 0.5);
+	unsigned int iv = (unsigned int)((v*0.5 + 0.5)*65535.0 + 0.5);
+	unsigned int packed = iu | (iv << 16);
+	return packed != normal_none ? packed : 0xffffffffu;
 }
 
-void triangle_from_3d(scene s) {
-	canvas_point one = coord_to_canvas(coord_to_viewport(coord_create(-0.25, -0.25, 2.0, 0.0)));
-	canvas_point two = coord_to_canvas(coord_to_viewport(coord_create(0.25, -0.25, 2.0, 0.0)));
-	canvas_point three= coord_to_canvas(coord_to_viewport(coord_create(0.0, 0.25, 2.0, 0.0)));
-	rgb_color interior = {240, 21, 14};
-	rgb_color exterior = {240, 21, 14};
-	triangle t = {one, two, three, interior, exterior};	
-
-	draw_triangle_interior(s, t, 10, 500, 990);
-	draw_triangle_outline(s,t);
+coord normal_decode(unsigned int packed) {
+	double u = (packed & 0xffff)/65535.0*2 - 1;
+	double v = (packed >> 16)/65535.0*2 - 1;
+	double z = 1 - fabs(u) - fabs(v);
+	if (z < 0) {
+		double fu = (1 - fabs(v))*(u < 0 ? -1 : 1);
+		double fv = (1 - fabs(u))*(v < 0 ? -1 : 1);
+		u = fu;
+		v = fv;
+	}
+	return coord_unit(coord_create(u, v, z, 0.0));
 }
 
-void cube_from_3d(scene s) {
-	canvas_point one = coord_to_canvas(coord_to_viewport(coord_create(-0.25, -0.25, 2.0, 0.0)));
-	canvas_point two = coord_to_canvas(coord_to_viewport(coord_create(0.25, -0.25, 2.0, 0.0)));
-	canvas_point three= coord_to_canvas(coord_to_viewport(coord_create(0.25, 0.25, 2.0, 0.0)));
-	canvas_point four = coord_to_canvas(coord_to_viewport(coord_create(-0.25, 0.25, 2.0, 0.0)));
-	
-	canvas_point one_rear = coord_to_canvas(coord_to_viewport(coord_create(-0.25, -0.25, 4.0, 0.0)));
-	canvas_point two_rear  = coord_to_canvas(coord_to_viewport(coord_create(0.25, -0.25, 4.0, 0.0)));
-	canvas_point three_rear = coord_to_canvas(coord_to_viewport(coord_create(0.25, 0.25, 4.0, 0.0)));
-	canvas_point four_rear = coord_to_canvas(coord_to_viewport(coord_create(-0.25, 0.25, 4.0, 0.0)));
+//spreads the low 16 bits of v out to the even bits
+unsigned int morton_spread(unsigned int v) {
+	v &= 0xffff;
+	v = (v | (v << 8)) & 0x00ff00ff;
+	v = (v | (v << 4)) & 0x0f0f0f0f;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
 
-	rgb_color color = {240, 21, 14};
+//where texel x, y of a level is stored. a level that is not square is a row or column
+//of morton ordered squares
+size_t texel_index(const texture_level * level, int x, int y) {
+	int square = level->log_width < level->log_height ? level->log_width : level->log_height;
+	unsigned int mask = (1u << square) - 1;
+	size_t inner = morton_spread(x & mask) | (morton_spread(y & mask) << 1);
+	return ((size_t)((x >> square) | (y >> square)) << (2*square)) | inner;
+}
 
-	drawline(s, one, two, color);
-	drawline(s, two, three, color);
-	drawline(s, three, four, color);
-	drawline(s, four, one, color);
-	
-	drawline(s, one_rear, two_rear, color);
-	drawline(s, two_rear, three_rear, color);
-	drawline(s, three_rear, four_rear, color);
-	drawline(s, four_rear, one_rear, color);
-	
-	drawline(s, one, one_rear, color);
-	drawline(s, two, two_rear, color);
-	drawline(s, three, three_rear, color);
-	drawline(s, four, four_rear, color);
+int log2_exact(int n) {
+	int log = 0;
+	while ((1 << log) < n) {
+		log++;
+	}
+	return log;
 }
 
-typedef struct raw_triangle {
-	coord a;
-	coord b;
-	coord c;
-} raw_triangle;
+//builds a texture from width*height packed rgba pixels, bottom row first. both sizes must
+//be powers of two. each level is box filtered from the one above and then swizzled
+texture * texture_create(int width, int height, const unsigned int * pixels) {
+	assert(width > 0 && height > 0 && !(width & (width - 1)) && !(height & (height - 1)));
+	texture * t = calloc(1, sizeof(texture));
+	t->width = width;
+	t->height = height;
+	t->filter = filter_trilinear;
+
+	size_t total = 0;
+	for (int w = width, h = height; ; w = w > 1 ? w/2 : 1, h = h > 1 ? h/2 : 1) {
+		total += (size_t)w*h;
+		t->n_levels++;
+		if (w == 1 && h == 1) {
+			break;
+		}
+	}
+	assert(t->n_levels <= max_texture_levels);
+	t->storage = malloc(total*sizeof(unsigned int));
+
+	unsigned int * rows = malloc((size_t)width*height*sizeof(unsigned int));
+	unsigned int * next_rows = malloc((size_t)width*height*sizeof(unsigned int));
+	memcpy(rows, pixels, (size_t)width*height*sizeof(unsigned int));
+	size_t offset = 0;
+	int w = width;
+	int h = height;
+	for (int i = 0; i < t->n_levels; i++) {
+		texture_level * level = &t->levels[i];
+		level->log_width = log2_exact(w);
+		level->log_height = log2_exact(h);
+		level->texels = &t->storage[offset];
+		offset += (size_t)w*h;
+		for (int y = 0; y < h; y++) {
+			for (int x = 0; x < w; x++) {
+				level->texels[texel_index(level, x, y)] = rows[y*w + x];
+			}
+		}
 
-raw_triangle raw_triangle_create(coord a, coord b, coord c) {
-	if (!(!coord_equal(a,b) && !coord_equal(b,c) && !coord_equal(a,c))) {
-		printf("Triangle has three equal coordd\n");
-		coord_print(a);
-		coord_print(b);
-		coord_print(c);
-		exit(0);
-	};
-	raw_triangle output = {a,b,c};
-	return output;
+		int next_w = w > 1 ? w/2 : 1;
+		int next_h = h > 1 ? h/2 : 1;
+		for (int y = 0; y < next_h; y++) {
+			for (int x = 0; x < next_w; x++) {
+				int x0 = 2*x < w ? 2*x : w - 1;
+				int x1 = 2*x + 1 < w ? 2*x + 1 : w - 1;
+				int y0 = 2*y < h ? 2*y : h - 1;
+				int y1 = 2*y + 1 < h ? 2*y + 1 : h - 1;
+				unsigned int corners[4] = {rows[y0*w + x0], rows[y0*w + x1], rows[y1*w + x0], rows[y1*w + x1]};
+				unsigned char bytes[4][4];
+				memcpy(bytes, corners, sizeof(bytes));
+				unsigned char average[4];
+				for (int k = 0; k < 4; k++) {
+					average[k] = (bytes[0][k] + bytes[1][k] + bytes[2][k] + bytes[3][k] + 2)/4;
+				}
+				memcpy(&next_rows[y*next_w + x], average, 4);
+			}
+		}
+		unsigned int * temp = rows;
+		rows = next_rows;
+		next_rows = temp;
+		w = next_w;
+		h = next_h;
+	}
+	free(rows);
+	free(next_rows);
+	return t;
 }
 
-coord coord_unit(coord intput_coord) {
-	double len = coord_length(intput_coord);
-	coord output = coord_scale(intput_coord, 1/len);
-	return output;
+void texture_free(texture * t) {
+	free(t->storage);
+	free(t);
 }
 
-double coord_project(coord n, coord l) {
-	double dot = n.x*l.x + n.y*l.y + n.z*l.z;
-	double len = (coord_length(n)* coord_length(l));
-	double output = dot/len;
-	assert(output*output < 1.01);
-	return output;
-} 
-
-int get_lighting (coord input_coord, coord normal) {
-	int max_intensity = 999;
+//reads an 8 bit binary ppm into rgb bytes, top row first. NULL if it cannot be read
+unsigned char * ppm_read(const char * path, int * width_out, int * height_out) {
+	FILE * file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return NULL;
+	}
+	int header[3];
+	int valid = fgetc(file) == 'P' && fgetc(file) == '6';
+	for (int i = 0; i < 3 && valid; i++) {
+		int c = fgetc(file);
+		while (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '#') {
+			if (c == '#') {
+				while (c != '\n' && c != EOF) {
+					c = fgetc(file);
+				}
+			}
+			c = fgetc(file);
+		}
+		ungetc(c, file);
+		valid = fscanf(file, "%d", &header[i]) == 1;
+	}
+	int width = header[0];
+	int height = header[1];
+	if (!valid || fgetc(file) == EOF || width <= 0 || height <= 0 || width > 32768 || height > 32768 || header[2] != 255) {
+		fprintf(stderr, "%s is not an 8 bit binary ppm\n", path);
+		fclose(file);
+		return NULL;
+	}
+	unsigned char * rgb = malloc(3*(size_t)width*height);
+	size_t read = fread(rgb, 3, (size_t)width*height, file);
+	fclose(file);
+	if (read != (size_t)width*height) {
+		fprintf(stderr, "%s is truncated\n", path);
+		free(rgb);
+		return NULL;
+	}
+	*width_out = width;
+	*height_out = height;
+	return rgb;
+}
 
-	//assume a single directional light 
-	coord light_vector = {0.4, 0.4, 1.0, 0.0};
-	light_vector = coord_unit(light_vector);
+//reads a binary ppm. sizes that are not powers of two are scaled up to the next ones,
+//sampling the nearest pixel
+texture * texture_load_ppm(const char * path) {
+	int width, height;
+	unsigned char * rgb = ppm_read(path, &width, &height);
+	if (!rgb) {
+		return NULL;
+	}
 
-	double diffuse = coord_project(normal, light_vector);
-	if (diffuse < 0.01) {
-		diffuse = 0;
-	} 
-	assert(diffuse < 1.01);
+	int texture_width = 1 << log2_exact(width);
+	int texture_height = 1 << log2_exact(height);
+	unsigned int * pixels = malloc((size_t)texture_width*texture_height*sizeof(unsigned int));
+	for (int y = 0; y < texture_height; y++) {
+		int source_y = height - 1 - (int)((long long)y*height/texture_height);
+		for (int x = 0; x < texture_width; x++) {
+			const unsigned char * c = &rgb[3*((size_t)source_y*width + (long long)x*width/texture_width)];
+			pixels[y*texture_width + x] = pixel_pack(create_color(c[0], c[1], c[2]));
+		}
+	}
+	texture * t = texture_create(texture_width, texture_height, pixels);
+	free(pixels);
+	free(rgb);
+	return t;
+}
 
-	coord R = coord_sub(coord_scale(normal, 2*coord_dot(normal,light_vector)), light_vector); 
-	coord V = coord_scale(input_coord, -1.0); //from point to camera;
+unsigned int texel_fetch(const texture_level * level, int x, int y) {
+	x &= (1 << level->log_width) - 1;
+	y &= (1 << level->log_height) - 1;
+	return level->texels[texel_index(level, x, y)];
+}
 
-	R.w = 0; 
-	V.w = 0;
-	
-	//coord_print(R);
-	//coord_print(V);
+//bilinear sample of one level into rgb, texture coordinates repeating outside [0, 1)
+void texture_sample_level(const texture_level * level, double u, double v, float rgb[3]) {
+	double x = (u - floor(u))*(1 << level->log_width) - 0.5;
+	double y = (v - floor(v))*(1 << level->log_height) - 0.5;
+	double fx = floor(x);
+	double fy = floor(y);
+	int x0 = (int)fx;
+	int y0 = (int)fy;
+	float tx = (float)(x - fx);
+	float ty = (float)(y - fy);
+	unsigned int texels[4] = {texel_fetch(level, x0, y0), texel_fetch(level, x0 + 1, y0), texel_fetch(level, x0, y0 + 1), texel_fetch(level, x0 + 1, y0 + 1)};
+	unsigned char bytes[4][4];
+	memcpy(bytes, texels, sizeof(bytes));
+	for (int k = 0; k < 3; k++) {
+		float bottom = bytes[0][k] + tx*(bytes[1][k] - bytes[0][k]);
+		float top = bytes[2][k] + tx*(bytes[3][k] - bytes[2][k]);
+		rgb[k] = bottom + ty*(top - bottom);
+	}
+}
 
-	double specular = coord_project(R,V);
-	specular = specular > 0 ? specular : 0;
-	double specular_power = specular;
+//samples t at u, v where a pixel spans 2^lod texels
+rgb_color texture_sample(const texture * t, double u, double v, double lod) {
+	float rgb[3];
+	if (t->filter == filter_nearest) {
+		const texture_level * level = &t->levels[0];
+		int x = (int)floor(u*t->width);
+		int y = (int)floor(v*t->height);
+		unsigned char bytes[4];
+		unsigned int texel = texel_fetch(level, x, y);
+		memcpy(bytes, &texel, 4);
+		return create_color(bytes[0], bytes[1], bytes[2]);
+	}
 
-	for (int i = 10; i > 0; i --) {
-		specular_power *= specular;
+	double top = t->n_levels - 1;
+	lod = lod > 0 ? (lod < top ? lod : top) : 0;
+	if (t->filter == filter_bilinear) {
+		texture_sample_level(&t->levels[(int)(lod + 0.5)], u, v, rgb);
+	} else {
+		int level = (int)lod;
+		float blend = (float)(lod - level);
+		texture_sample_level(&t->levels[level], u, v, rgb);
+		if (blend > 0 && level < top) {
+			float coarser[3];
+			texture_sample_level(&t->levels[level + 1], u, v, coarser);
+			for (int k = 0; k < 3; k++) {
+				rgb[k] += blend*(coarser[k] - rgb[k]);
+			}
+		}
 	}
+	return create_color((unsigned char)(rgb[0] + 0.5f), (unsigned char)(rgb[1] + 0.5f), (unsigned char)(rgb[2] + 0.5f));
+}
 
-	//specular = specular_power*10;
+//attributes interpolated with perspective: the normal in 0 to 2 for per pixel lighting
+//and the texture coordinates in 3 and 4. each is held times 1/z as a plane
+//a + dx*x + dy*y over the screen. like 1/z they are linear in screen space, so dividing
+//by 1/z at a pixel gives the perspective correct value there
+enum {plane_nx, plane_ny, plane_nz, plane_u, plane_v, n_planes};
 
-	assert(specular < 1.01);
-	printf("Specular: %f\n", specular);
-	if (specular < 0.01) {
-		specular = 0;
-	} 
+typedef struct attribute_planes {
+	double a[n_planes];
+	double dx[n_planes];
+	double dy[n_planes];
 
-	double intensity = 0.2 + 0.4*diffuse + 0.4*specular; 
-	//printf("Intensity intesity: %f\n", intensity);
+	//the vertical step of 1/z, which texturing needs to find the mip level
+	double w_dy;
+} attribute_planes;
 
-	int return_intensity =	(int)(intensity*((double)max_intensity));
-	
-	return return_intensity;
+//one row of a triangle: the pixels [x0, x1) of screen row y together with the edge
+//functions, 1/z and intensity at x0 and their steps per pixel across and per row down
+typedef struct fill_span {
+	int y;
+	int x0;
+	int x1;
+	long long e[3];
+	long long e_dx[3];
+	long long e_dy[3];
+	double w;
+	double w_dx;
+	double w_dy;
+	double h;
+	double h_dx;
+	double h_dy;
+	rgb_color color;
+	const attribute_planes * planes;
+
+	//the moves to each sample, when multisampling or counting coverage
+	const struct sample_steps * steps;
+} fill_span;
+
+//where a pixel's samples sit, in sixteenths of a pixel from its centre. canvas points are
+//in sixteenths as well, so the edge functions move to a sample exactly. the patterns are
+//the usual rotated grids, no two samples sharing a row or a column
+#define max_samples 8
+#define sample_unit 16
+_Static_assert(subpixel_scale % sample_unit == 0, "sample offsets must be whole canvas steps");
+const int sample_offsets_1[1][2] = {{0, 0}};
+const int sample_offsets_4[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+const int sample_offsets_8[8][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+
+const int (*sample_offsets(int samples))[2] {
+	return samples == 8 ? sample_offsets_8 : samples == 4 ? sample_offsets_4 : sample_offsets_1;
 }
 
-coord coord_cross(coord a,coord b) {
-	coord output = {a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x, 0.0};
-	output = coord_unit(output);
-	return output;
+//how far the edge functions, 1/z and the intensity of a span move from a pixel's centre
+//to each of its samples, and per edge the least and most of those moves
+typedef struct sample_steps {
+	long long e[3][max_samples];
+	long long e_low[3];
+	long long e_high[3];
+	double w[max_samples];
+	double h[max_samples];
+} sample_steps;
+
+sample_steps span_sample_steps(int samples, const fill_span * span) {
+	const int (*offsets)[2] = sample_offsets(samples);
+	sample_steps steps;
+	for (int i = 0; i < 3; i++) {
+		steps.e_low[i] = LLONG_MAX;
+		steps.e_high[i] = LLONG_MIN;
+		for (int k = 0; k < samples; k++) {
+			steps.e[i][k] = (offsets[k][0]*span->e_dx[i] + offsets[k][1]*span->e_dy[i])/sample_unit;
+			steps.e_low[i] = steps.e[i][k] < steps.e_low[i] ? steps.e[i][k] : steps.e_low[i];
+			steps.e_high[i] = steps.e[i][k] > steps.e_high[i] ? steps.e[i][k] : steps.e_high[i];
+		}
+	}
+	for (int k = 0; k < samples; k++) {
+		steps.w[k] = (offsets[k][0]*span->w_dx + offsets[k][1]*span->w_dy)/sample_unit;
+		steps.h[k] = (offsets[k][0]*span->h_dx + offsets[k][1]*span->h_dy)/sample_unit;
+	}
+	return steps;
 }
 
-coord get_triangle_normal(raw_triangle t) {
-	coord l1 = coord_sub(t.b,t.a);
-	coord l2 = coord_sub(t.c,t.a);
-	coord output = coord_unit(coord_cross(l1,l2));
-	return output;
+void fill_span_scalar(const scene * s, fill_span span) {
+	long long e0 = span.e[0];
+	long long e1 = span.e[1];
+	long long e2 = span.e[2];
+	double w = span.w;
+	double intensity = span.h;
+	int row = span.y*s->screen_width;
+
+	for (int x = span.x0; x < span.x1; x++) {
+		depth_value depth = depth_encode(w);
+		if ((e0 | e1 | e2) >= 0 && s->depth_buffer[row + x] < depth) {
+			s->screen[row + x] = pixel_pack(color_scale(span.color, (int)intensity));
+			s->depth_buffer[row + x] = depth;
+		}
+		e0 += span.e_dx[0];
+		e1 += span.e_dx[1];
+		e2 += span.e_dx[2];
+		w += span.w_dx;
+		intensity += span.h_dx;
+	}
 }
 
-triangle raw_to_processed_triangle(raw_triangle t, rgb_color red, rgb_color blue) {
-	triangle processed_triangle;
-	coord normal_vec = get_triangle_normal(t);
-
-	processed_triangle.color = red;
-	processed_triangle.outline_color = blue;
+//counts the pixels, or with multisampling the samples, of the span inside the triangle,
+//ignoring depth
+void fill_span_coverage(const scene * s, fill_span span) {
+	int n = s->samples;
+	const sample_steps * steps = span.steps;
+	long long e0 = span.e[0];
+	long long e1 = span.e[1];
+	long long e2 = span.e[2];
+	int row = span.y*s->screen_width;
+
+	for (int x = span.x0; x < span.x1; x++) {
+		for (int k = 0; k < n; k++) {
+			if (((e0 + steps->e[0][k]) | (e1 + steps->e[1][k]) | (e2 + steps->e[2][k])) >= 0) {
+				s->coverage[(size_t)(row + x)*n + k]++;
+			}
+		}
+		e0 += span.e_dx[0];
+		e1 += span.e_dx[1];
+		e2 += span.e_dx[2];
+	}
+}
 
-	processed_triangle.p1 = coord_to_canvas(coord_to_viewport(t.a));
-	processed_triangle.p2 = coord_to_canvas(coord_to_viewport(t.b));
-	processed_triangle.p3 = coord_to_canvas(coord_to_viewport(t.c));
+//the light scale, below color_max, of pixel x, y at 1/z w with the interpolated normal
+//nx, ny, nz. a normal that has vanished gets the ambient light alone
+int pixel_light(const scene * s, int x, int y, double w, double nx, double ny, double nz) {
+	coord normal = coord_create(nx, ny, nz, 0.0);
+	double length = coord_length(normal);
+	double intensity = length > 0 ? light_intensity(s->lights, pixel_view_position(s, x, y, w), coord_scale(normal, 1/length)) : s->lights->ambient;
+	int scale = (int)(intensity*color_max);
+	return scale < color_max ? scale : color_max - 1;
+}
 
-	//need to calculate lighting for these
-	processed_triangle.p1l = get_lighting(t.a,normal_vec);
-	processed_triangle.p2l = get_lighting(t.b, normal_vec);
-	processed_triangle.p3l = get_lighting(t.c, normal_vec);
-	int temp_light;
+//lights every pixel that passes the depth test. the view space position is recovered
+//from the pixel and its 1/z, and the normal from the planes in span.planes
+void fill_span_phong(const scene * s, fill_span span) {
+	const attribute_planes * n = span.planes;
+	long long e0 = span.e[0];
+	long long e1 = span.e[1];
+	long long e2 = span.e[2];
+	double w = span.w;
+	double nx = n->a[0] + n->dx[0]*span.x0 + n->dy[0]*span.y;
+	double ny = n->a[1] + n->dx[1]*span.x0 + n->dy[1]*span.y;
+	double nz = n->a[2] + n->dx[2]*span.x0 + n->dy[2]*span.y;
+	int row = span.y*s->screen_width;
+
+	for (int x = span.x0; x < span.x1; x++) {
+		depth_value depth = depth_encode(w);
+		if ((e0 | e1 | e2) >= 0 && s->depth_buffer[row + x] < depth) {
+			s->screen[row + x] = pixel_pack(color_scale(span.color, pixel_light(s, x, span.y, w, nx, ny, nz)));
+			s->depth_buffer[row + x] = depth;
+		}
+		e0 += span.e_dx[0];
+		e1 += span.e_dx[1];
+		e2 += span.e_dx[2];
+		w += span.w_dx;
+		nx += n->dx[0];
+		ny += n->dx[1];
+		nz += n->dx[2];
+	}
+}
 
-	canvas_point temp;
+//the g-buffer pass of deferred shading: pixels passing the depth test get the
+//triangle's colour and its interpolated normal, and are lit later
+void fill_span_deferred(const scene * s, fill_span span) {
+	const attribute_planes * n = span.planes;
+	long long e0 = span.e[0];
+	long long e1 = span.e[1];
+	long long e2 = span.e[2];
+	double w = span.w;
+	double nx = n->a[0] + n->dx[0]*span.x0 + n->dy[0]*span.y;
+	double ny = n->a[1] + n->dx[1]*span.x0 + n->dy[1]*span.y;
+	double nz = n->a[2] + n->dx[2]*span.x0 + n->dy[2]*span.y;
+	unsigned int albedo = pixel_pack(span.color);
+	int row = span.y*s->screen_width;
+
+	for (int x = span.x0; x < span.x1; x++) {
+		depth_value depth = depth_encode(w);
+		if ((e0 | e1 | e2) >= 0 && s->depth_buffer[row + x] < depth) {
+			s->screen[row + x] = albedo;
+			s->normal_buffer[row + x] = normal_encode(nx, ny, nz);
+			s->depth_buffer[row + x] = depth;
+		}
+		e0 += span.e_dx[0];
+		e1 += span.e_dx[1];
+		e2 += span.e_dx[2];
+		w += span.w_dx;
+		nx += n->dx[0];
+		ny += n->dx[1];
+		nz += n->dx[2];
+	}
+}
 
-	if (processed_triangle.p1.y > processed_triangle.p2.y) {
-		temp = processed_triangle.p1; 
-		processed_triangle.p1 = processed_triangle.p2;
-		processed_triangle.p2 = temp;
+//the texel for a pixel of span at 1/z w with attribute values a. the mip level comes from
+//how far the texture coordinates move, in texels, between neighbouring pixels
+rgb_color span_texel(const fill_span * span, const texture * t, const double a[n_planes], double w) {
+	const attribute_planes * n = span->planes;
+	double z = 1/w;
+	double u = a[plane_u]*z;
+	double v = a[plane_v]*z;
+	double du_dx = (n->dx[plane_u] - u*span->w_dx)*z*t->width;
+	double dv_dx = (n->dx[plane_v] - v*span->w_dx)*z*t->height;
+	double du_dy = (n->dy[plane_u] - u*n->w_dy)*z*t->width;
+	double dv_dy = (n->dy[plane_v] - v*n->w_dy)*z*t->height;
+	double rho_x = du_dx*du_dx + dv_dx*dv_dx;
+	double rho_y = du_dy*du_dy + dv_dy*dv_dy;
+	double lod = 0.5*log2(rho_x > rho_y ? rho_x : rho_y);
+	return texture_sample(t, u, v, lod);
+}
 
-		temp_light = processed_triangle.p1l;
-		processed_triangle.p1l = processed_triangle.p2l;
-		processed_triangle.p2l = temp_light;
+//textured pixels, in any shading mode. u/z, v/z and 1/z are stepped across the span and
+//divided per pixel
+void fill_span_textured(const scene * s, fill_span span) {
+	const attribute_planes * n = span.planes;
+	const texture * t = s->texture;
+	int shading = s->lights->shading;
+	long long e0 = span.e[0];
+	long long e1 = span.e[1];
+	long long e2 = span.e[2];
+	double w = span.w;
+	double intensity = span.h;
+	double a[n_planes];
+	for (int k = 0; k < n_planes; k++) {
+		a[k] = n->a[k] + n->dx[k]*span.x0 + n->dy[k]*span.y;
 	}
-	
-	if (processed_triangle.p2.y > processed_triangle.p3.y) {
-		temp = processed_triangle.p2; 
-		processed_triangle.p2 = processed_triangle.p3;
-		processed_triangle.p3 = temp;
-		
-		temp_light = processed_triangle.p2l;
-		processed_triangle.p2l = processed_triangle.p3l;
-		processed_triangle.p3l = temp_light;
+	int row = span.y*s->screen_width;
+
+	for (int x = span.x0; x < span.x1; x++) {
+		depth_value depth = depth_encode(w);
+		if ((e0 | e1 | e2) >= 0 && s->depth_buffer[row + x] < depth) {
+			rgb_color albedo = span_texel(&span, t, a, w);
+
+			if (shading == shade_deferred) {
+				s->screen[row + x] = pixel_pack(albedo);
+				s->normal_buffer[row + x] = normal_encode(a[plane_nx], a[plane_ny], a[plane_nz]);
+			} else {
+				int scale = shading == shade_pixel ? pixel_light(s, x, span.y, w, a[plane_nx], a[plane_ny], a[plane_nz]) : (int)intensity;
+				s->screen[row + x] = pixel_pack(color_scale(albedo, scale));
+			}
+			s->depth_buffer[row + x] = depth;
+		}
+		e0 += span.e_dx[0];
+		e1 += span.e_dx[1];
+		e2 += span.e_dx[2];
+		w += span.w_dx;
+		intensity += span.h_dx;
+		for (int k = 0; k < n_planes; k++) {
+			a[k] += n->dx[k];
+		}
 	}
-	
-	if (processed_triangle.p1.y > processed_triangle.p2.y) {
-		temp = processed_triangle.p1; 
-		processed_triangle.p1 = processed_triangle.p2;
-		processed_triangle.p2 = temp;
-		
-		temp_light = processed_triangle.p1l;
-		processed_triangle.p1l = processed_triangle.p2l;
-		processed_triangle.p2l = temp_light;
+}
+
+//the colour of a multisampled pixel of span, shaded once from its attribute planes taken
+//fx, fy pixels from the centre of pixel x, and its normal for deferred shading
+unsigned int shade_fragment(const scene * s, const fill_span * span, int x, double fx, double fy, unsigned int * normal) {
+	const attribute_planes * n = span->planes;
+	double along = x - span->x0 + fx;
+	double w = span->w + span->w_dx*along + span->w_dy*fy;
+	double a[n_planes];
+	for (int k = 0; k < n_planes; k++) {
+		a[k] = n->a[k] + n->dx[k]*(x + fx) + n->dy[k]*(span->y + fy);
+	}
+	rgb_color albedo = s->texture ? span_texel(span, s->texture, a, w) : span->color;
+	int shading = s->lights->shading;
+	if (shading == shade_deferred) {
+		*normal = normal_encode(a[plane_nx], a[plane_ny], a[plane_nz]);
+		return pixel_pack(albedo);
 	}
-	return processed_triangle;	
+	int scale = shading == shade_pixel ? pixel_light(s, x, span->y, w, a[plane_nx], a[plane_ny], a[plane_nz]) : (int)(span->h + span->h_dx*along + span->h_dy*fy);
+	return pixel_pack(color_scale(albedo, scale));
 }
 
-void pyramid(scene s) {
-	rgb_color red = {244, 23, 43};
-	rgb_color blue = {23, 43, 243};
-
-	double offset = 0.2;
-	coord points [4] = {
-		coord_create(0.0, -0.25, 2.0 , 0.0),
-		coord_create(-0.25, -0.25, 2.3 , 0.0),
-		coord_create(0.25, -0.25, 2.3 , 0.0),
-		coord_create(0.0, 0.25, 2.15 , 0.0),
-	};
+//multisampled pixels, in any shading mode. every sample is edge and depth tested on its
+//own; a pixel wholly inside the triangle is found with one test per edge. flat and vertex
+//lit colours are worked out per sample, which costs no more than interpolating them. with
+//attribute planes the pixel is shaded once, at its centre when every sample is covered and
+//otherwise at its first covered sample so nothing is taken from outside the triangle
+void fill_span_multisample(const scene * s, fill_span span) {
+	int n = s->samples;
+	int all = (1 << n) - 1;
+	const int (*offsets)[2] = sample_offsets(n);
+	const sample_steps * steps = span.steps;
+	long long e0 = span.e[0];
+	long long e1 = span.e[1];
+	long long e2 = span.e[2];
+	double w = span.w;
+	double intensity = span.h;
+	int row = span.y*s->screen_width;
+
+	for (int x = span.x0; x < span.x1; x++) {
+		int mask = 0;
+		if (((e0 + steps->e_low[0]) | (e1 + steps->e_low[1]) | (e2 + steps->e_low[2])) >= 0) {
+			mask = all;
+		} else if (e0 + steps->e_high[0] >= 0 && e1 + steps->e_high[1] >= 0 && e2 + steps->e_high[2] >= 0) {
+			for (int k = 0; k < n; k++) {
+				mask |= (((e0 + steps->e[0][k]) | (e1 + steps->e[1][k]) | (e2 + steps->e[2][k])) >= 0) << k;
+			}
+		}
 
-	enum {FRONT = 0, LEFT = 1, RIGHT = 2, TOP = 3};
-	raw_triangle triangles [4] = {
-		raw_triangle_create(points[LEFT], points[FRONT], points[RIGHT]),
-		raw_triangle_create(points[RIGHT], points[FRONT], points[TOP]),
-		raw_triangle_create(points[LEFT], points[FRONT], points[TOP]),
-		raw_triangle_create(points[TOP], points[RIGHT], points[LEFT]),
-	}; 
+		size_t base = (size_t)(row + x)*n;
+		int passed = 0;
+		for (int k = 0; k < n && mask; k++) {
+			depth_value depth = depth_encode(w + steps->w[k]);
+			if ((mask >> k & 1) && s->sample_depth[base + k] < depth) {
+				s->sample_depth[base + k] = depth;
+				passed |= 1 << k;
+			}
+		}
 
-	triangle final_triangles [4];
-	for (int i = 0; i < 4; i++) {
-		final_triangles[i] = raw_to_processed_triangle(triangles[i], red, blue);	
-	}	
-	
-	for (int i = 0; i < 4; i++) {
-		draw_triangle(s, final_triangles[i]);
-	}	
+		if (passed && span.planes) {
+			int first = mask == all ? -1 : __builtin_ctz(mask);
+			double fx = first < 0 ? 0 : (double)offsets[first][0]/sample_unit;
+			double fy = first < 0 ? 0 : (double)offsets[first][1]/sample_unit;
+			unsigned int normal = 0;
+			unsigned int color = shade_fragment(s, &span, x, fx, fy, &normal);
+			for (int k = 0; k < n; k++) {
+				if (passed >> k & 1) {
+					s->sample_color[base + k] = color;
+				}
+				if ((passed >> k & 1) && s->lights->shading == shade_deferred) {
+					s->sample_normal[base + k] = normal;
+				}
+			}
+		} else if (passed) {
+			for (int k = 0; k < n; k++) {
+				if (passed >> k & 1) {
+					s->sample_color[base + k] = pixel_pack(color_scale(span.color, (int)(intensity + steps->h[k])));
+				}
+			}
+		}
 
+		e0 += span.e_dx[0];
+		e1 += span.e_dx[1];
+		e2 += span.e_dx[2];
+		w += span.w_dx;
+		intensity += span.h_dx;
+	}
 }
 
-void tirangle_cube(scene s) {
-	rgb_color red = {244, 23, 43};
-	rgb_color blue = {23, 43, 243};
-
-	double offset = 0.2;
-	coord points [8] = {
-		coord_create(-0.25, -0.25, 2.0 , 0.0),
-		coord_create(0.25, -0.25, 2.0 , 0.0),
-		coord_create(-0.25, 0.25, 2.0 , 0.0),
-		coord_create(0.25, 0.25, 2.0 , 0.0),
-		coord_create(-0.25, -0.25, 2.5 , 0.0),
-		coord_create(0.25, -0.25, 2.5 , 0.0),
-		coord_create(-0.25, 0.25, 2.5 , 0.0),
-		coord_create(0.25, 0.25, 2.5 , 0.0),
-	};
+#if defined(__x86_64__) || defined(__i386__)
+//shades, depth tests and writes 8 pixels per iteration. the edge functions are held in
+//32 bit lanes, so the caller only uses this for triangles whose edge functions fit
+__attribute__((target("avx2")))
+void fill_span_avx2(const scene * s, fill_span span) {
+	__m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i e0 = _mm256_add_epi32(_mm256_set1_epi32((int)span.e[0]), _mm256_mullo_epi32(lane, _mm256_set1_epi32((int)span.e_dx[0])));
+	__m256i e1 = _mm256_add_epi32(_mm256_set1_epi32((int)span.e[1]), _mm256_mullo_epi32(lane, _mm256_set1_epi32((int)span.e_dx[1])));
+	__m256i e2 = _mm256_add_epi32(_mm256_set1_epi32((int)span.e[2]), _mm256_mullo_epi32(lane, _mm256_set1_epi32((int)span.e_dx[2])));
+	__m256i e0_step = _mm256_set1_epi32((int)(8*span.e_dx[0]));
+	__m256i e1_step = _mm256_set1_epi32((int)(8*span.e_dx[1]));
+	__m256i e2_step = _mm256_set1_epi32((int)(8*span.e_dx[2]));
+
+	__m256 w = _mm256_add_ps(_mm256_set1_ps((float)span.w), _mm256_mul_ps(_mm256_cvtepi32_ps(lane), _mm256_set1_ps((float)span.w_dx)));
+	__m256 w_step = _mm256_set1_ps((float)(8*span.w_dx));
+#ifdef DEPTH_FIXED24
+	__m256 to_fixed = _mm256_set1_ps((float)depth_fixed_scale);
+	__m256i fixed_max = _mm256_set1_epi32(16777215);
+#endif
+
+	__m256 h = _mm256_add_ps(_mm256_set1_ps((float)span.h), _mm256_mul_ps(_mm256_cvtepi32_ps(lane), _mm256_set1_ps((float)span.h_dx)));
+	__m256 h_step = _mm256_set1_ps((float)(8*span.h_dx));
+	__m256 to_scale = _mm256_set1_ps(1.0f/color_max);
+	__m256 base_r = _mm256_set1_ps(span.color.r);
+	__m256 base_g = _mm256_set1_ps(span.color.g);
+	__m256 base_b = _mm256_set1_ps(span.color.b);
+	__m256i alpha = _mm256_set1_epi32(0xff000000);
+
+	__m256i minus_one = _mm256_set1_epi32(-1);
+	int row = span.y*s->screen_width;
+
+	for (int x = span.x0; x < span.x1; x += 8) {
+		__m256i in_span = _mm256_cmpgt_epi32(_mm256_set1_epi32(span.x1 - x), lane);
+		__m256i covered = _mm256_and_si256(in_span, _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(e0, e1), e2), minus_one));
+
+		if (!_mm256_testz_si256(covered, covered)) {
+			depth_value * depth = &s->depth_buffer[row + x];
+#ifdef DEPTH_FIXED24
+			__m256i fixed = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(w, to_fixed)), fixed_max);
+			__m256i stored = _mm256_maskload_epi32((const int *)depth, covered);
+			__m256i passed = _mm256_and_si256(covered, _mm256_cmpgt_epi32(fixed, stored));
+			_mm256_maskstore_epi32((int *)depth, passed, fixed);
+#else
+			__m256 stored = _mm256_maskload_ps(depth, covered);
+			__m256i passed = _mm256_and_si256(covered, _mm256_castps_si256(_mm256_cmp_ps(stored, w, _CMP_LT_OQ)));
+			_mm256_maskstore_ps(depth, passed, w);
+#endif
+
+			if (!_mm256_testz_si256(passed, passed)) {
+				__m256 scale = _mm256_mul_ps(h, to_scale);
+				__m256i r = _mm256_cvttps_epi32(_mm256_mul_ps(base_r, scale));
+				__m256i g = _mm256_cvttps_epi32(_mm256_mul_ps(base_g, scale));
+				__m256i b = _mm256_cvttps_epi32(_mm256_mul_ps(base_b, scale));
+				__m256i pixels = _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)), _mm256_or_si256(_mm256_slli_epi32(b, 16), alpha));
+				_mm256_maskstore_epi32((int *)&s->screen[row + x], passed, pixels);
+			}
+		}
 
-	enum {BLF = 0, BRF = 1, TLF = 2, TRF = 3, BLB = 4, BRB = 5, TLB = 6, TRB = 7};
-	raw_triangle triangles [12] = {
-		raw_triangle_create(points[BLF], points[BRF], points[TRF]),
-		raw_triangle_create(points[TRF], points[TLF], points[BLF]),
-		raw_triangle_create(points[BLB], points[BRB], points[TRB]),
-		raw_triangle_create(points[TRB], points[TLB], points[BLB]),
-		raw_triangle_create(points[BRF], points[BLF], points[BLB]),
-		raw_triangle_create(points[BLB], points[BRB], points[BRF]),
-		raw_triangle_create(points[TRF], points[TLF], points[TLB]),
-		raw_triangle_create(points[TLB], points[TRB], points[TRF]),
-		raw_triangle_create(points[BRF], points[TRB], points[BRB]),
-		raw_triangle_create(points[TRF], points[TRB], points[BRF]),
-		raw_triangle_create(points[BLF], points[TLB], points[BLB]),
-		raw_triangle_create(points[TLF], points[TLB], points[BLF]),
-	}; 
+		e0 = _mm256_add_epi32(e0, e0_step);
+		e1 = _mm256_add_epi32(e1, e1_step);
+		e2 = _mm256_add_epi32(e2, e2_step);
+		w = _mm256_add_ps(w, w_step);
+		h = _mm256_add_ps(h, h_step);
+	}
+}
 
-	triangle final_triangles [12];
-	for (int i = 0; i < 12; i++) {
-		final_triangles[i] = raw_to_processed_triangle(triangles[i], red, blue);	
-	}	
-	
-	for (int i = 0; i < 12; i++) {
-		draw_triangle(s, final_triangles[i]);
-	}	
+//fill_span_multisample for flat and vertex lit triangles, one sample to a lane: two pixels
+//per iteration at 4 samples, one at 8. the samples of a pixel are stored together, so each
+//iteration loads and stores one run of 8 depths and colours. 32 bit edge functions again
+__attribute__((target("avx2")))
+void fill_span_multisample_avx2(const scene * s, fill_span span) {
+	int n = s->samples;
+	int per_step = 8/n;
+	const sample_steps * steps = span.steps;
+	int lane_pixel[8];
+	int lane_e[3][8];
+	float lane_w[8];
+	float lane_h[8];
+	for (int l = 0; l < 8; l++) {
+		int p = l/n;
+		int k = l%n;
+		lane_pixel[l] = p;
+		for (int i = 0; i < 3; i++) {
+			lane_e[i][l] = (int)(p*span.e_dx[i] + steps->e[i][k]);
+		}
+		lane_w[l] = (float)(p*span.w_dx + steps->w[k]);
+		lane_h[l] = (float)(p*span.h_dx + steps->h[k]);
+	}
+	__m256i pixel = _mm256_loadu_si256((const __m256i *)lane_pixel);
+	__m256i e0 = _mm256_add_epi32(_mm256_set1_epi32((int)span.e[0]), _mm256_loadu_si256((const __m256i *)lane_e[0]));
+	__m256i e1 = _mm256_add_epi32(_mm256_set1_epi32((int)span.e[1]), _mm256_loadu_si256((const __m256i *)lane_e[1]));
+	__m256i e2 = _mm256_add_epi32(_mm256_set1_epi32((int)span.e[2]), _mm256_loadu_si256((const __m256i *)lane_e[2]));
+	__m256i e0_step = _mm256_set1_epi32((int)(per_step*span.e_dx[0]));
+	__m256i e1_step = _mm256_set1_epi32((int)(per_step*span.e_dx[1]));
+	__m256i e2_step = _mm256_set1_epi32((int)(per_step*span.e_dx[2]));
+
+	__m256 w = _mm256_add_ps(_mm256_set1_ps((float)span.w), _mm256_loadu_ps(lane_w));
+	__m256 w_step = _mm256_set1_ps((float)(per_step*span.w_dx));
+#ifdef DEPTH_FIXED24
+	__m256 to_fixed = _mm256_set1_ps((float)depth_fixed_scale);
+	__m256i fixed_max = _mm256_set1_epi32(16777215);
+#endif
+
+	__m256 h = _mm256_add_ps(_mm256_set1_ps((float)span.h), _mm256_loadu_ps(lane_h));
+	__m256 h_step = _mm256_set1_ps((float)(per_step*span.h_dx));
+	__m256 to_scale = _mm256_set1_ps(1.0f/color_max);
+	__m256 base_r = _mm256_set1_ps(span.color.r);
+	__m256 base_g = _mm256_set1_ps(span.color.g);
+	__m256 base_b = _mm256_set1_ps(span.color.b);
+	__m256i alpha = _mm256_set1_epi32(0xff000000);
+
+	__m256i minus_one = _mm256_set1_epi32(-1);
+	int row = span.y*s->screen_width;
+
+	for (int x = span.x0; x < span.x1; x += per_step) {
+		__m256i in_span = _mm256_cmpgt_epi32(_mm256_set1_epi32(span.x1 - x), pixel);
+		__m256i covered = _mm256_and_si256(in_span, _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(e0, e1), e2), minus_one));
+
+		if (!_mm256_testz_si256(covered, covered)) {
+			size_t base = (size_t)(row + x)*n;
+			depth_value * depth = &s->sample_depth[base];
+#ifdef DEPTH_FIXED24
+			__m256i fixed = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(w, to_fixed)), fixed_max);
+			__m256i stored = _mm256_maskload_epi32((const int *)depth, covered);
+			__m256i passed = _mm256_and_si256(covered, _mm256_cmpgt_epi32(fixed, stored));
+			_mm256_maskstore_epi32((int *)depth, passed, fixed);
+#else
+			__m256 stored = _mm256_maskload_ps(depth, covered);
+			__m256i passed = _mm256_and_si256(covered, _mm256_castps_si256(_mm256_cmp_ps(stored, w, _CMP_LT_OQ)));
+			_mm256_maskstore_ps(depth, passed, w);
+#endif
+
+			if (!_mm256_testz_si256(passed, passed)) {
+				__m256 scale = _mm256_mul_ps(h, to_scale);
+				__m256i r = _mm256_cvttps_epi32(_mm256_mul_ps(base_r, scale));
+				__m256i g = _mm256_cvttps_epi32(_mm256_mul_ps(base_g, scale));
+				__m256i b = _mm256_cvttps_epi32(_mm256_mul_ps(base_b, scale));
+				__m256i colors = _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)), _mm256_or_si256(_mm256_slli_epi32(b, 16), alpha));
+				_mm256_maskstore_epi32((int *)&s->sample_color[base], passed, colors);
+			}
+		}
 
+		e0 = _mm256_add_epi32(e0, e0_step);
+		e1 = _mm256_add_epi32(e1, e1_step);
+		e2 = _mm256_add_epi32(e2, e2_step);
+		w = _mm256_add_ps(w, w_step);
+		h = _mm256_add_ps(h, h_step);
+	}
+}
+#endif
+
+//scalar unless fill_kernel_init finds a wider kernel the cpu supports
+void (*fill_span_wide)(const scene * s, fill_span span) = fill_span_scalar;
+void (*fill_span_multisample_wide)(const scene * s, fill_span span) = fill_span_multisample;
+
+void fill_kernel_init() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fill_span_wide = fill_span_avx2;
+		fill_span_multisample_wide = fill_span_multisample_avx2;
+	}
+#endif
 }
 
-void clear_scene(scene * s, rgb_color background_color) {
-	for (int i = 0; i < 1920*1080; i++) {
-		s->screen[i] = 0;
+//fills rows y0 to y1 of a triangle, span holding the first row and the steps to the next
+void fill_rows(const scene * s, void (*fill)(const scene *, fill_span), fill_span span, int y0, int y1) {
+	for (int y = y0; y <= y1; y++) {
+		span.y = y;
+		fill(s, span);
+		span.e[0] += span.e_dy[0];
+		span.e[1] += span.e_dy[1];
+		span.e[2] += span.e_dy[2];
+		span.w += span.w_dy;
+		span.h += span.h_dy;
 	}
 }
 
-int main() {	
-	unsigned char * screen = calloc(3*1920*1080,sizeof(unsigned char));
+//a triangle ready to fill, worked out once however many tiles it lands in. the edge
+//functions are in 256ths of a square pixel: each is taken at the centre of the screen's
+//pixel 0, 0 and stepped per pixel, and a pixel is inside where all three are >= 0.
+//1/z and the intensity are planes over the screen likewise, and x0, y0, x1, y1 bound the
+//pixels whose centres may be inside. two cache lines
+typedef struct triangle_setup {
+	long long e[3];
+	int e_dx[3];
+	int e_dy[3];
+	double w;
+	double w_dx;
+	double w_dy;
+	double h;
+	double h_dx;
+	double h_dy;
+	double nearest;
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+	rgb_color color;
+} triangle_setup;
+_Static_assert(sizeof(triangle_setup) == 128, "setup records are two cache lines");
+
+//the setup records of a draw and, when the fill needs them, their attribute planes. like
+//the triangle buffers it keeps its size between frames. the records start on a cache line
+typedef struct setup_buffer {
+	triangle_setup * records;
+	attribute_planes * planes;
+	int capacity;
+	int planes_capacity;
+} setup_buffer;
+
+triangle_setup * setup_buffer_reserve(setup_buffer * buffer, int n, int with_planes) {
+	if (n > buffer->capacity) {
+		buffer->capacity = n > 2*buffer->capacity ? n : 2*buffer->capacity;
+		free(buffer->records);
+		buffer->records = aligned_alloc(64, ((buffer->capacity*sizeof(triangle_setup) + 63)/64)*64);
+	}
+	if (with_planes && n > buffer->planes_capacity) {
+		buffer->planes_capacity = n > 2*buffer->planes_capacity ? n : 2*buffer->planes_capacity;
+		free(buffer->planes);
+		buffer->planes = malloc(buffer->planes_capacity*sizeof(attribute_planes));
+	}
+	return buffer->records;
+}
 
-	unsigned int VAO;	
-	unsigned int program; 
-	unsigned int texture;
+//sets up t, and its attribute planes when planes is not NULL. returns 0 when the
+//triangle has no area or no pixel of the screen can be inside it
+int setup_triangle(scene s, triangle t, triangle_setup * out, attribute_planes * planes) {
+	canvas_point p[3] = {t.p1, t.p2, t.p3};
+	double h[3] = {t.p1l, t.p2l, t.p3l};
+	packed_normal n[3] = {t.n1, t.n2, t.n3};
+	texture_coord uv[3] = {t.uv1, t.uv2, t.uv3};
+	assert(h[0] < color_max && h[1] < color_max && h[2] < color_max);
+
+	long long area = (long long)(p[1].x - p[0].x)*(p[2].y - p[0].y) - (long long)(p[1].y - p[0].y)*(p[2].x - p[0].x);
+	if (area == 0) {
+		return 0;
+	}
+	if (area < 0) {
+		canvas_point temp = p[1];
+		p[1] = p[2];
+		p[2] = temp;
+		double temp_h = h[1];
+		h[1] = h[2];
+		h[2] = temp_h;
+		packed_normal temp_n = n[1];
+		n[1] = n[2];
+		n[2] = temp_n;
+		texture_coord temp_uv = uv[1];
+		uv[1] = uv[2];
+		uv[2] = temp_uv;
+		area = -area;
+	}
 
-	scene new_scene;
-	new_scene.screen_width = 1920;
-	new_scene.screen_height = 1080;
-	new_scene.depth_buffer = calloc(new_scene.screen_width * new_scene.screen_height, sizeof(double));
-	new_scene.screen = calloc(3*new_scene.screen_height*new_scene.screen_width, sizeof(unsigned char));
-	new_scene.scene_arena = int_arena_create(10000);
-
-	//triangle new_triangle = triangle_create(-300, -300, 300, -300, 0, 300, 20, 160, 20, 0, 0, 0);
-	//draw_triangle(new_scene, new_triangle); 
-	//triangle_from_3d(new_scene);
-	//cube_from_3d(new_scene);
-	//tirangle_cube(new_scene); 
-	pyramid(new_scene);
-
-	GLFWwindow  * window = opengl_init(&VAO, &program, &texture);	
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1920, 1080, 0, GL_RGB ,GL_UNSIGNED_BYTE, new_scene.screen);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	rgb_color background = {0,0,0};
+	//the pixels with centres inside the bounding box, found with shifts that round down.
+	//pixel x has its centre at (x - screen_width/2)*16 + 8 on the canvas
+	int min_x = p[0].x < p[1].x ? p[0].x : p[1].x;
+	min_x = min_x < p[2].x ? min_x : p[2].x;
+	int max_x = p[0].x > p[1].x ? p[0].x : p[1].x;
+	max_x = max_x > p[2].x ? max_x : p[2].x;
+	int min_y = p[0].y < p[1].y ? p[0].y : p[1].y;
+	min_y = min_y < p[2].y ? min_y : p[2].y;
+	int max_y = p[0].y > p[1].y ? p[0].y : p[1].y;
+	max_y = max_y > p[2].y ? max_y : p[2].y;
+
+	//with multisampling the samples reach nearly to a pixel's sides, so it is the pixels the
+	//box overlaps at all
+	int half = subpixel_scale/2;
+	if (s.samples > 1) {
+		out->x0 = (min_x >> subpixel_bits) + s.screen_width/2;
+		out->x1 = (max_x >> subpixel_bits) + s.screen_width/2;
+		out->y0 = (min_y >> subpixel_bits) + s.screen_height/2;
+		out->y1 = (max_y >> subpixel_bits) + s.screen_height/2;
+	} else {
+		out->x0 = ((min_x + half - 1) >> subpixel_bits) + s.screen_width/2;
+		out->x1 = ((max_x - half) >> subpixel_bits) + s.screen_width/2;
+		out->y0 = ((min_y + half - 1) >> subpixel_bits) + s.screen_height/2;
+		out->y1 = ((max_y - half) >> subpixel_bits) + s.screen_height/2;
+	}
+	out->x0 = out->x0 > 0 ? out->x0 : 0;
+	out->x1 = out->x1 < s.screen_width - 1 ? out->x1 : s.screen_width - 1;
+	out->y0 = out->y0 > 0 ? out->y0 : 0;
+	out->y1 = out->y1 < s.screen_height - 1 ? out->y1 : s.screen_height - 1;
+	if (out->x0 > out->x1 || out->y0 > out->y1) {
+		return 0;
+	}
 
-	int i = 0;
+	//edge i runs between the two vertices opposite vertex i
+	long long origin_x = (long long)(-s.screen_width/2)*subpixel_scale + half;
+	long long origin_y = (long long)(-s.screen_height/2)*subpixel_scale + half;
+	for (int i = 0; i < 3; i++) {
+		canvas_point a = p[(i+1)%3];
+		canvas_point b = p[(i+2)%3];
+		out->e_dx[i] = (a.y - b.y)*subpixel_scale;
+		out->e_dy[i] = (b.x - a.x)*subpixel_scale;
+		out->e[i] = (long long)(b.x - a.x)*(origin_y - a.y) - (long long)(b.y - a.y)*(origin_x - a.x);
+		if (!edge_is_top_left(a, b)) {
+			out->e[i] -= 1;
+		}
+	}
 
-	while(!glfwWindowShouldClose(window)) {
-		handle_close(window);
-		glClearColor(0.3, 0.6, 1.0, 1.0);
-		glClear(GL_COLOR_BUFFER_BIT);
+	//1/z and intensity are planes over the triangle, stepped per pixel. 1/z is linear in
+	//screen space, so depth comes out perspective correct
+	double x10 = (double)(p[1].x - p[0].x)/subpixel_scale;
+	double y10 = (double)(p[1].y - p[0].y)/subpixel_scale;
+	double x20 = (double)(p[2].x - p[0].x)/subpixel_scale;
+	double y20 = (double)(p[2].y - p[0].y)/subpixel_scale;
+	double inv_area = (double)(subpixel_scale*subpixel_scale)/(double)area;
+	double to_origin_x = (origin_x - p[0].x)/(double)subpixel_scale;
+	double to_origin_y = (origin_y - p[0].y)/(double)subpixel_scale;
+
+	double w[3] = {1/p[0].z, 1/p[1].z, 1/p[2].z};
+	out->nearest = w[0] > w[1] ? w[0] : w[1];
+	out->nearest = out->nearest > w[2] ? out->nearest : w[2];
+	out->w_dx = ((w[1] - w[0])*y20 - (w[2] - w[0])*y10)*inv_area;
+	out->w_dy = ((w[2] - w[0])*x10 - (w[1] - w[0])*x20)*inv_area;
+	out->h_dx = ((h[1] - h[0])*y20 - (h[2] - h[0])*y10)*inv_area;
+	out->h_dy = ((h[2] - h[0])*x10 - (h[1] - h[0])*x20)*inv_area;
+	out->w = w[0] + out->w_dx*to_origin_x + out->w_dy*to_origin_y;
+	out->h = h[0] + out->h_dx*to_origin_x + out->h_dy*to_origin_y;
+	out->color = t.color;
+
+	if (planes) {
+		double aw[3][n_planes];
+		for (int i = 0; i < 3; i++) {
+			aw[i][plane_nx] = n[i].x*w[i];
+			aw[i][plane_ny] = n[i].y*w[i];
+			aw[i][plane_nz] = n[i].z*w[i];
+			aw[i][plane_u] = uv[i].u*w[i];
+			aw[i][plane_v] = uv[i].v*w[i];
+		}
+		for (int k = 0; k < n_planes; k++) {
+			planes->dx[k] = ((aw[1][k] - aw[0][k])*y20 - (aw[2][k] - aw[0][k])*y10)*inv_area;
+			planes->dy[k] = ((aw[2][k] - aw[0][k])*x10 - (aw[1][k] - aw[0][k])*x20)*inv_area;
+			planes->a[k] = aw[0][k] + planes->dx[k]*to_origin_x + planes->dy[k]*to_origin_y;
+		}
+		planes->w_dy = out->w_dy;
+	}
+	return 1;
+}
+
+//fills the pixels of a set up triangle inside the scene's clip rectangle. planes are the
+//triangle's attribute planes, or NULL for a flat or vertex lit fill
+void fill_triangle(scene s, const triangle_setup * t, const attribute_planes * planes) {
+	int sx0 = t->x0 > s.clip_x0 ? t->x0 : s.clip_x0;
+	int sx1 = t->x1 < s.clip_x1 - 1 ? t->x1 : s.clip_x1 - 1;
+	int sy0 = t->y0 > s.clip_y0 ? t->y0 : s.clip_y0;
+	int sy1 = t->y1 < s.clip_y1 - 1 ? t->y1 : s.clip_y1 - 1;
+	if (sx0 > sx1 || sy0 > sy1) {
+		return;
+	}
+
+	//the whole triangle is rejected when its nearest vertex is behind the farthest pixel of
+	//every coarse depth block under it. depth is interpolated as 1/z
+	double nearest = t->nearest;
+	double farthest = INFINITY;
+	int exhaustive = s.reference_fill || s.coverage;
+	for (int by = sy0/depth_block; by <= sy1/depth_block && !exhaustive; by++) {
+		for (int bx = sx0/depth_block; bx <= sx1/depth_block; bx++) {
+			double d = s.coarse_depth[by*s.coarse_width + bx];
+			farthest = d < farthest ? d : farthest;
+		}
+	}
+	if (!exhaustive && nearest <= farthest) {
+		return;
+	}
+
+	//the edge functions at the corners of the box. an edge the whole box is inside drops
+	//out of the fill, which also keeps the rest small enough for the wide kernel's 32 bit
+	//lanes as long as every corner's values fit. with multisampling the samples lie up to
+	//half a pixel beyond the pixel centres, so the tests here and on blocks below allow
+	//the margin an edge function or 1/z can change by over half a pixel each way
+	int multisample = s.samples > 1;
+	long long e_row[3];
+	long long e_dx[3];
+	long long e_dy[3];
+	long long margin[3];
+	int fits_32 = 1;
+	for (int i = 0; i < 3; i++) {
+		e_dx[i] = t->e_dx[i];
+		e_dy[i] = t->e_dy[i];
+		margin[i] = multisample ? (llabs(e_dx[i]) + llabs(e_dy[i]))/2 : 0;
+		e_row[i] = t->e[i] + sx0*e_dx[i] + sy0*e_dy[i];
+		long long e10 = e_row[i] + (sx1 - sx0)*e_dx[i];
+		long long e01 = e_row[i] + (sy1 - sy0)*e_dy[i];
+		long long e11 = e10 + (sy1 - sy0)*e_dy[i];
+		long long low = e_row[i] < e10 ? e_row[i] : e10;
+		low = (low < e01 ? low : e01) - margin[i];
+		low = low < e11 - margin[i] ? low : e11 - margin[i];
+		long long high = e_row[i] > e10 ? e_row[i] : e10;
+		high = (high > e01 ? high : e01) + margin[i];
+		high = high > e11 + margin[i] ? high : e11 + margin[i];
+		if (high < 0) {
+			return;
+		}
+		if (low >= 0) {
+			e_row[i] = 0;
+			e_dx[i] = 0;
+			e_dy[i] = 0;
+			margin[i] = 0;
+			continue;
+		}
+		if (low <= INT_MIN || high >= INT_MAX) {
+			fits_32 = 0;
+		}
+	}
+	double w_margin = multisample ? (fabs(t->w_dx) + fabs(t->w_dy))/2 : 0;
+
+	double w_dx = t->w_dx;
+	double w_dy = t->w_dy;
+	double h_dx = t->h_dx;
+	double h_dy = t->h_dy;
+	double w_row = t->w + w_dx*sx0 + w_dy*sy0;
+	double h_row = t->h + h_dx*sx0 + h_dy*sy0;
+
+	void (*fill)(const scene *, fill_span) = fits_32 && !exhaustive ? fill_span_wide : fill_span_scalar;
+	if (planes) {
+		if (s.texture) {
+			fill = fill_span_textured;
+		} else {
+			fill = s.lights->shading == shade_pixel ? fill_span_phong : fill_span_deferred;
+		}
+	}
+	if (multisample) {
+		fill = fits_32 && !exhaustive && !planes ? fill_span_multisample_wide : fill_span_multisample;
+	}
+	if (s.coverage) {
+		fill = fill_span_coverage;
+	}
+
+	//y is left for fill_rows to set row by row
+	fill_span span = {
+		.x0 = sx0,
+		.x1 = sx1 + 1,
+		.e = {e_row[0], e_row[1], e_row[2]},
+		.e_dx = {e_dx[0], e_dx[1], e_dx[2]},
+		.e_dy = {e_dy[0], e_dy[1], e_dy[2]},
+		.w = w_row,
+		.w_dx = w_dx,
+		.w_dy = w_dy,
+		.h = h_row,
+		.h_dx = h_dx,
+		.h_dy = h_dy,
+		.color = t->color,
+		.planes = planes,
+		.steps = NULL,
+	};
+	sample_steps steps;
+	if (multisample || s.coverage) {
+		steps = span_sample_steps(s.samples, &span);
+		span.steps = &steps;
+	}
+
+	//small triangles are filled straight off, the block tests would cost more than they save
+	if (exhaustive || sx1 - sx0 < 2*depth_block || sy1 - sy0 < 2*depth_block) {
+		fill_rows(&s, fill, span, sy0, sy1);
+		return;
+	}
+
+	//bigger ones are walked in bands of depth_block rows cut into depth_block square blocks.
+	//blocks the triangle misses, or where the coarse depth shows everything is already nearer
+	//than the triangle gets, are skipped and runs of the remaining blocks are filled. a block
+	//the triangle covers completely has its coarse depth raised to the triangle's farthest
+	//point in it, since afterwards no pixel there can be farther than that
+	for (int by = sy0 - sy0 % depth_block; by <= sy1; by += depth_block) {
+		int y0 = by > sy0 ? by : sy0;
+		int y1 = by + depth_block - 1 < sy1 ? by + depth_block - 1 : sy1;
+		int run_x0 = -1;
+		int run_x1 = -1;
+
+		for (int bx = sx0 - sx0 % depth_block; bx <= sx1 + depth_block; bx += depth_block) {
+			int x0 = bx > sx0 ? bx : sx0;
+			int x1 = bx + depth_block - 1 < sx1 ? bx + depth_block - 1 : sx1;
+			int live = bx <= sx1;
+			int covered = 1;
+			for (int i = 0; i < 3 && live; i++) {
+				long long e00 = e_row[i] + (x0 - sx0)*e_dx[i] + (y0 - sy0)*e_dy[i];
+				long long e10 = e00 + (x1 - x0)*e_dx[i];
+				long long e01 = e00 + (y1 - y0)*e_dy[i];
+				long long e11 = e10 + (y1 - y0)*e_dy[i];
+				long long m = margin[i];
+				if (e00 + m < 0 && e10 + m < 0 && e01 + m < 0 && e11 + m < 0) {
+					live = 0;
+				}
+				if (e00 - m < 0 || e10 - m < 0 || e01 - m < 0 || e11 - m < 0) {
+					covered = 0;
+				}
+			}
+
+			if (live) {
+				double w00 = w_row + (x0 - sx0)*w_dx + (y0 - sy0)*w_dy;
+				double w10 = w00 + (x1 - x0)*w_dx;
+				double w01 = w00 + (y1 - y0)*w_dy;
+				double w11 = w10 + (y1 - y0)*w_dy;
+				double block_near = fmax(fmax(w00, w10), fmax(w01, w11)) + w_margin;
+				double block_far = fmin(fmin(w00, w10), fmin(w01, w11)) - w_margin;
+				block_near = block_near < nearest ? block_near : nearest;
+
+				double * coarse = &s.coarse_depth[(by/depth_block)*s.coarse_width + bx/depth_block];
+				if (block_near <= *coarse) {
+					live = 0;
+				} else if (covered && x0 == bx && y0 == by && x1 == bx + depth_block - 1 && y1 == by + depth_block - 1) {
+					//a little under the exact value, the kernels step 1/z in single precision
+					//and may land just short of it
+					double block_depth = block_far*(1 - 1e-5);
+					*coarse = block_depth > *coarse ? block_depth : *coarse;
+				}
+			}
+
+			if (live) {
+				run_x0 = run_x0 < 0 ? x0 : run_x0;
+				run_x1 = x1;
+			} else if (run_x0 >= 0) {
+				fill_span run = span;
+				run.x0 = run_x0;
+				run.x1 = run_x1 + 1;
+				for (int i = 0; i < 3; i++) {
+					run.e[i] += (run_x0 - sx0)*e_dx[i] + (y0 - sy0)*e_dy[i];
+				}
+				run.w += (run_x0 - sx0)*w_dx + (y0 - sy0)*w_dy;
+				run.h += (run_x0 - sx0)*h_dx + (y0 - sy0)*h_dy;
+				fill_rows(&s, fill, run, y0, y1);
+				run_x0 = -1;
+			}
+		}
+	}
+}
+
+//a draw split over the screen's tiles. setup readies item i and gives the box of pixels it
+//may touch, clamped to the screen, returning how much work the item is or 0 when it misses
+//the screen. draw then draws item i clipped to the tile scene's clip rectangle
+typedef struct tiled_draw {
+	long long (*setup)(const scene * s, void * data, int i, int * box);
+	void (*draw)(const scene * tile_scene, void * data, int i);
+	void * data;
+} tiled_draw;
+
+//sets every item up, bins them into the tiles their boxes touch, then draws the tiles in
+//parallel. each tile is owned by one thread so the screen and depth buffer need no locking.
+//returns the work setup reported over all the items
+long long draw_tiled(scene s, const tiled_draw * d, int n_items) {
+	int tiles_x = (s.screen_width + tile_size - 1)/tile_size;
+	int tiles_y = (s.screen_height + tile_size - 1)/tile_size;
+	int n_tiles = tiles_x*tiles_y;
+
+	//the bins live in the scene arena for the length of the call. room for the counts and
+	//the items' tile ranges is reserved first and the bins themselves once the counts are
+	//known, so pointers are taken again after the second reserve
+	int_arena * arena = s.scene_arena;
+	int mark = int_arena_mark(arena);
+	int_arena_reserve(arena, 2*n_tiles + 1 + 4*n_items);
+	int * tile_offsets = int_arena_alloc(arena, n_tiles + 1);
+	int * tile_fill = int_arena_alloc(arena, n_tiles);
+	int * item_tiles = int_arena_alloc(arena, 4*n_items);
+	for (int i = 0; i <= n_tiles; i++) {
+		tile_offsets[i] = 0;
+	}
+
+	double setup_start = omp_get_wtime();
+	long long work = 0;
+
+	//items missing the screen get an empty range
+	#pragma omp parallel for reduction(+:work)
+	for (int i = 0; i < n_items; i++) {
+		int * t = &item_tiles[4*i];
+		long long item_work = d->setup(&s, d->data, i, t);
+		if (item_work == 0) {
+			t[0] = 0; t[1] = 0; t[2] = -1; t[3] = -1;
+			continue;
+		}
+		t[0] /= tile_size;
+		t[1] /= tile_size;
+		t[2] /= tile_size;
+		t[3] /= tile_size;
+		work += item_work;
+	}
+
+	//count the items landing in each tile
+	for (int i = 0; i < n_items; i++) {
+		const int * t = &item_tiles[4*i];
+		for (int ty = t[1]; ty <= t[3]; ty++) {
+			for (int tx = t[0]; tx <= t[2]; tx++) {
+				tile_offsets[ty*tiles_x + tx + 1]++;
+			}
+		}
+	}
+
+	for (int i = 0; i < n_tiles; i++) {
+		tile_offsets[i+1] += tile_offsets[i];
+	}
+
+	int_arena_reserve(arena, tile_offsets[n_tiles] + 1);
+	tile_offsets = &arena->storage[mark];
+	tile_fill = tile_offsets + n_tiles + 1;
+	item_tiles = tile_fill + n_tiles;
+	int * tile_items = int_arena_alloc(arena, tile_offsets[n_tiles] + 1);
+
+	//fill the bins in submission order so overlapping items resolve the same way on every run
+	for (int i = 0; i < n_tiles; i++) {
+		tile_fill[i] = tile_offsets[i];
+	}
+	for (int i = 0; i < n_items; i++) {
+		const int * t = &item_tiles[4*i];
+		for (int ty = t[1]; ty <= t[3]; ty++) {
+			for (int tx = t[0]; tx <= t[2]; tx++) {
+				tile_items[tile_fill[ty*tiles_x + tx]++] = i;
+			}
+		}
+	}
+
+	double fill_start = omp_get_wtime();
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int tile = 0; tile < n_tiles; tile++) {
+		if (tile_offsets[tile] == tile_offsets[tile+1]) {
+			continue;
+		}
+
+		scene tile_scene = s;
+		tile_scene.clip_x0 = (tile % tiles_x)*tile_size;
+		tile_scene.clip_y0 = (tile / tiles_x)*tile_size;
+		tile_scene.clip_x1 = tile_scene.clip_x0 + tile_size < s.screen_width ? tile_scene.clip_x0 + tile_size : s.screen_width;
+		tile_scene.clip_y1 = tile_scene.clip_y0 + tile_size < s.screen_height ? tile_scene.clip_y0 + tile_size : s.screen_height;
+
+		for (int i = tile_offsets[tile]; i < tile_offsets[tile+1]; i++) {
+			d->draw(&tile_scene, d->data, tile_items[i]);
+		}
+	}
+
+	int_arena_rewind(arena, mark);
+
+	if (s.stats) {
+		s.stats->setup += fill_start - setup_start;
+		s.stats->fill += omp_get_wtime() - fill_start;
+	}
+	return work;
+}
+
+typedef struct triangle_batch {
+	const triangle * triangles;
+	triangle_setup * records;
+	attribute_planes * planes;
+} triangle_batch;
+
+//the work is the triangle's doubled area in subpixels
+long long triangle_batch_setup(const scene * s, void * data, int i, int * box) {
+	triangle_batch * b = data;
+	triangle t = b->triangles[i];
+	triangle_setup * r = &b->records[i];
+	if (!setup_triangle(*s, t, r, b->planes ? &b->planes[i] : NULL)) {
+		return 0;
+	}
+	box[0] = r->x0;
+	box[1] = r->y0;
+	box[2] = r->x1;
+	box[3] = r->y1;
+	long long area = llabs((long long)(t.p2.x - t.p1.x)*(t.p3.y - t.p1.y) - (long long)(t.p2.y - t.p1.y)*(t.p3.x - t.p1.x));
+	return area > 0 ? area : 1;
+}
+
+void triangle_batch_draw(const scene * tile_scene, void * data, int i) {
+	triangle_batch * b = data;
+	fill_triangle(*tile_scene, &b->records[i], b->planes ? &b->planes[i] : NULL);
+}
+
+//sets every triangle up and rasterizes them tile by tile through draw_tiled
+void draw_triangles(scene s, triangle * triangles, int n_triangles) {
+	int with_planes = s.lights->shading != shade_vertex || s.texture;
+	triangle_batch batch;
+	batch.triangles = triangles;
+	batch.records = setup_buffer_reserve(s.setup_storage, n_triangles, with_planes);
+	batch.planes = with_planes ? s.setup_storage->planes : NULL;
+	tiled_draw d = {triangle_batch_setup, triangle_batch_draw, &batch};
+	long long area = draw_tiled(s, &d, n_triangles);
+
+	if (s.stats) {
+		s.stats->triangles += n_triangles;
+		s.stats->pixels += area/(2*subpixel_scale*subpixel_scale);
+	}
+}
+
+//lines. a line is drawn one pixel per step along its longer axis, its position across
+//and its 1/z stepped incrementally. both ends are included
+typedef struct line_segment {
+	canvas_point a;
+	canvas_point b;
+	rgb_color color;
+} line_segment;
+
+//how much nearer than its ends a line is depth tested, as a fraction of 1/z, so lines win
+//against the faces they lie on
+#define line_depth_bias 1e-3
+
+//blends color into pixel index with the given coverage where it passes the depth test
+void line_blend(const scene * s, int index, double w, rgb_color color, double coverage) {
+	if (depth_encode(w) < s->depth_buffer[index] || coverage <= 0) {
+		return;
+	}
+	unsigned char under[4];
+	memcpy(under, &s->screen[index], 4);
+	rgb_color mixed;
+	mixed.r = (unsigned char)(under[0] + (color.r - under[0])*coverage + 0.5);
+	mixed.g = (unsigned char)(under[1] + (color.g - under[1])*coverage + 0.5);
+	mixed.b = (unsigned char)(under[2] + (color.b - under[2])*coverage + 0.5);
+	s->screen[index] = pixel_pack(mixed);
+}
+
+//draws the part of l inside the scene's clip rectangle. hard lines write the depth they
+//pass with. smooth lines are anti-aliased as Wu's are, the two pixels straddling the line
+//at each step sharing its coverage, and blended over the screen without writing depth
+void draw_line(const scene * s, line_segment l, int smooth) {
+	assert(l.a.z > 0 && l.b.z > 0);
+
+	//pixel coordinates, whole numbers at pixel centres, with u along the longer axis
+	double ax = (double)l.a.x/subpixel_scale + s->screen_width/2 - 0.5;
+	double ay = (double)l.a.y/subpixel_scale + s->screen_height/2 - 0.5;
+	double bx = (double)l.b.x/subpixel_scale + s->screen_width/2 - 0.5;
+	double by = (double)l.b.y/subpixel_scale + s->screen_height/2 - 0.5;
+	int steep = fabs(by - ay) > fabs(bx - ax);
+	double u0 = steep ? ay : ax;
+	double v0 = steep ? ax : ay;
+	double w0 = (1 + line_depth_bias)/l.a.z;
+	double u1 = steep ? by : bx;
+	double v1 = steep ? bx : by;
+	double w1 = (1 + line_depth_bias)/l.b.z;
+	if (u0 > u1) {
+		double temp = u0;
+		u0 = u1;
+		u1 = temp;
+		temp = v0;
+		v0 = v1;
+		v1 = temp;
+		temp = w0;
+		w0 = w1;
+		w1 = temp;
+	}
+	int low_u = steep ? s->clip_y0 : s->clip_x0;
+	int high_u = (steep ? s->clip_y1 : s->clip_x1) - 1;
+	int low_v = steep ? s->clip_x0 : s->clip_y0;
+	int high_v = (steep ? s->clip_x1 : s->clip_y1) - 1;
+
+	double length = u1 - u0;
+	double inv_length = length > 0 ? 1/length : 0;
+	double slope = (v1 - v0)*inv_length;
+	double w_slope = (w1 - w0)*inv_length;
+
+	//the steps along the line that are inside the clip rectangle, or within a pixel of it
+	//across, worked out in doubles before anything is made an int. most lines are short
+	//and stay inside across, so only those that do not pay for the divides
+	double first = fmax(floor(u0 + 0.5), low_u);
+	double last = fmin(floor(u1 + 0.5), high_u);
+	if (fmin(v0, v1) < low_v - 1 || fmax(v0, v1) > high_v + 1) {
+		if (slope == 0) {
+			return;
+		}
+		double enter = u0 + (low_v - 1 - v0)/slope;
+		double leave = u0 + (high_v + 1 - v0)/slope;
+		first = fmax(first, floor(fmin(enter, leave)));
+		last = fmin(last, ceil(fmax(enter, leave)));
+	}
+	if (first > last) {
+		return;
+	}
+
+	int u_stride = steep ? s->screen_width : 1;
+	int v_stride = steep ? 1 : s->screen_width;
+	double v = v0 + slope*(first - u0);
+	double w = w0 + w_slope*(first - u0);
+	for (int u = (int)first; u <= (int)last; u++) {
+		if (smooth) {
+			double below = floor(v);
+			int vi = (int)below;
+			double f = v - below;
+			if (vi >= low_v && vi <= high_v) {
+				line_blend(s, u*u_stride + vi*v_stride, w, l.color, 1 - f);
+			}
+			if (vi + 1 >= low_v && vi + 1 <= high_v) {
+				line_blend(s, u*u_stride + (vi + 1)*v_stride, w, l.color, f);
+			}
+		} else {
+			int vi = (int)floor(v + 0.5);
+			int index = u*u_stride + vi*v_stride;
+			depth_value depth = depth_encode(w);
+			if (vi >= low_v && vi <= high_v && depth >= s->depth_buffer[index]) {
+				s->screen[index] = pixel_pack(l.color);
+				s->depth_buffer[index] = depth;
+			}
+		}
+		v += slope;
+		w += w_slope;
+	}
+}
+
+typedef struct line_batch {
+	const line_segment * lines;
+	int smooth;
+} line_batch;
+
+//a line's box is a pixel wider than its ends all round, for smooth lines
+long long line_batch_setup(const scene * s, void * data, int i, int * box) {
+	line_segment l = ((line_batch *)data)->lines[i];
+	int x0 = ((l.a.x < l.b.x ? l.a.x : l.b.x) >> subpixel_bits) + s->screen_width/2 - 1;
+	int y0 = ((l.a.y < l.b.y ? l.a.y : l.b.y) >> subpixel_bits) + s->screen_height/2 - 1;
+	int x1 = ((l.a.x > l.b.x ? l.a.x : l.b.x) >> subpixel_bits) + s->screen_width/2 + 1;
+	int y1 = ((l.a.y > l.b.y ? l.a.y : l.b.y) >> subpixel_bits) + s->screen_height/2 + 1;
+	if (x1 < 0 || y1 < 0 || x0 >= s->screen_width || y0 >= s->screen_height) {
+		return 0;
+	}
+	box[0] = x0 < 0 ? 0 : x0;
+	box[1] = y0 < 0 ? 0 : y0;
+	box[2] = x1 >= s->screen_width ? s->screen_width - 1 : x1;
+	box[3] = y1 >= s->screen_height ? s->screen_height - 1 : y1;
+	return 1;
+}
+
+void line_batch_draw(const scene * tile_scene, void * data, int i) {
+	line_batch * b = data;
+	draw_line(tile_scene, b->lines[i], b->smooth);
+}
+
+//draws the lines tile by tile through draw_tiled. lines go to the screen and depth buffer,
+//so a multisampled scene draws them after scene_end_frame has resolved it
+void draw_lines(scene s, const line_segment * lines, int n_lines, int smooth) {
+	line_batch batch = {lines, smooth};
+	tiled_draw d = {line_batch_setup, line_batch_draw, &batch};
+	draw_tiled(s, &d, n_lines);
+}
+
+//growable storage for the lines of a draw, kept between frames as triangle_buffer is
+typedef struct line_buffer {
+	line_segment * items;
+	int capacity;
+} line_buffer;
+
+line_segment * line_buffer_reserve(line_buffer * buffer, int n) {
+	if (n > buffer->capacity) {
+		buffer->capacity = n > 2*buffer->capacity ? n : 2*buffer->capacity;
+		buffer->items = realloc(buffer->items, buffer->capacity*sizeof(line_segment));
+	}
+	return buffer->items;
+}
+
+typedef struct raw_triangle {
+	coord a;
+	coord b;
+	coord c;
+} raw_triangle;
+
+raw_triangle raw_triangle_create(coord a, coord b, coord c) {
+	if (!(!coord_equal(a,b) && !coord_equal(b,c) && !coord_equal(a,c))) {
+		printf("Triangle has three equal coordd\n");
+		coord_print(a);
+		coord_print(b);
+		coord_print(c);
+		exit(0);
+	};
+	raw_triangle output = {a,b,c};
+	return output;
+}
+
+double coord_project(coord n, coord l) {
+	double dot = n.x*l.x + n.y*l.y + n.z*l.z;
+	double len = (coord_length(n)* coord_length(l));
+	double output = dot/len;
+	assert(output*output < 1.01);
+	return output;
+} 
+
+coord get_triangle_normal(raw_triangle t) {
+	coord l1 = coord_sub(t.b,t.a);
+	coord l2 = coord_sub(t.c,t.a);
+	coord output = coord_unit(coord_cross(l1,l2));
+	return output;
+}
+
+//growable storage for the triangles of a draw. it keeps its size between frames so only
+//the largest draw seen so far ever allocates
+typedef struct triangle_buffer {
+	triangle * items;
+	int capacity;
+} triangle_buffer;
+
+triangle * triangle_buffer_reserve(triangle_buffer * buffer, int n) {
+	if (n > buffer->capacity) {
+		buffer->capacity = n > 2*buffer->capacity ? n : 2*buffer->capacity;
+		buffer->items = realloc(buffer->items, buffer->capacity*sizeof(triangle));
+	}
+	return buffer->items;
+}
+
+//clipping works on homogeneous clip space coordinates, before the divide. a point is on
+//screen when |x| <= w*width/2 and |y| <= w*height/2, and in front of the near plane when
+//z >= 0. triangles reaching off the screen are left for the rasterizer's bounding box to
+//trim as long as they stay inside the much wider guard band, so only triangles crossing
+//the near plane or the guard band are cut up
+#define guard_band 8000.0
+
+enum {clip_left = 1, clip_right = 2, clip_bottom = 4, clip_top = 8, clip_near = 16, clip_guard = 32};
+#define clip_outside (clip_left | clip_right | clip_bottom | clip_top | clip_near)
+
+enum {cull_none = 0, cull_back = 1, cull_front = 2};
+
+int clip_outcode(scene s, coord v) {
+	double half_width = 0.5*s.screen_width*v.w;
+	double half_height = 0.5*s.screen_height*v.w;
+	int code = 0;
+	code |= v.x < -half_width ? clip_left : 0;
+	code |= v.x > half_width ? clip_right : 0;
+	code |= v.y < -half_height ? clip_bottom : 0;
+	code |= v.y > half_height ? clip_top : 0;
+	code |= v.z < 0 ? clip_near : 0;
+	code |= fabs(v.x) > guard_band*v.w || fabs(v.y) > guard_band*v.w ? clip_guard : 0;
+	return code;
+}
+
+//the corners of a box transformed by m, tested against the frustum. the box is outside
+//when all eight corners are outside the same plane
+int box_outside_frustum(scene s, matrix m, coord low, coord high) {
+	int outside = clip_outside;
+	for (int i = 0; i < 8 && outside; i++) {
+		coord corner = coord_create(i & 1 ? high.x : low.x, i & 2 ? high.y : low.y, i & 4 ? high.z : low.z, 1.0);
+		outside &= clip_outcode(s, matrix_vector_mul(m, corner));
+	}
+	return outside != 0;
+}
+
+//normals point out of the front of a face, so a face is seen from behind when its normal
+//points away from the camera sitting at the origin of view space
+int face_culled(scene s, coord normal, coord position) {
+	if (s.cull == cull_none) {
+		return 0;
+	}
+	normal.w = 0;
+	position.w = 0;
+	double facing = coord_dot(normal, position);
+	return s.cull == cull_back ? facing >= 0 : facing <= 0;
+}
+
+typedef struct clip_vertex {
+	coord position;
+	double light;
+	coord normal;
+	texture_coord uv;
+} clip_vertex;
+
+//Sutherland-Hodgman against the near plane and, when the triangle leaves it, the four guard
+//band planes. what is left is a convex polygon of at most eight vertices, divided and fanned
+//into triangles appended to out. returns the new number of triangles in out
+int clip_triangle(clip_vertex v[3], int outcode, triangle base, triangle_buffer * out, int n_out) {
+	coord planes[5] = {
+		{0.0, 0.0, 1.0, 0.0},
+		{1.0, 0.0, 0.0, guard_band},
+		{-1.0, 0.0, 0.0, guard_band},
+		{0.0, 1.0, 0.0, guard_band},
+		{0.0, -1.0, 0.0, guard_band},
+	};
+	int n_planes = outcode & clip_guard ? 5 : 1;
+
+	clip_vertex polygons[2][9];
+	clip_vertex * in = polygons[0];
+	clip_vertex * next = polygons[1];
+	int n = 3;
+	in[0] = v[0];
+	in[1] = v[1];
+	in[2] = v[2];
+
+	for (int p = 0; p < n_planes && n >= 3; p++) {
+		int m = 0;
+		for (int i = 0; i < n; i++) {
+			clip_vertex a = in[i];
+			clip_vertex b = in[(i+1)%n];
+			double da = coord_dot(planes[p], a.position);
+			double db = coord_dot(planes[p], b.position);
+			if (da >= 0) {
+				next[m++] = a;
+			}
+			if ((da >= 0) != (db >= 0)) {
+				double t = da/(da - db);
+				next[m].position = coord_add(a.position, coord_scale(coord_sub(b.position, a.position), t));
+				next[m].light = a.light + t*(b.light - a.light);
+				next[m].normal = coord_add(a.normal, coord_scale(coord_sub(b.normal, a.normal), t));
+				next[m].uv.u = a.uv.u + t*(b.uv.u - a.uv.u);
+				next[m].uv.v = a.uv.v + t*(b.uv.v - a.uv.v);
+				m++;
+			}
+		}
+		clip_vertex * temp = in;
+		in = next;
+		next = temp;
+		n = m;
+	}
+	if (n < 3) {
+		return n_out;
+	}
+
+	//w is the view space depth, which is what canvas points carry as z
+	canvas_point points[8];
+	int lights[8];
+	packed_normal normals[8];
+	for (int i = 0; i < n; i++) {
+		double inv_w = 1.0/in[i].position.w;
+		points[i] = create_point(canvas_snap(in[i].position.x*inv_w), canvas_snap(in[i].position.y*inv_w), in[i].position.w);
+		lights[i] = (int)in[i].light;
+		normals[i] = normal_pack(in[i].normal);
+	}
+
+	triangle * items = triangle_buffer_reserve(out, n_out + n - 2);
+	for (int i = 1; i + 1 < n; i++) {
+		triangle * t = &items[n_out++];
+		*t = base;
+		t->p1 = points[0];
+		t->p2 = points[i];
+		t->p3 = points[i+1];
+		t->p1l = lights[0];
+		t->p2l = lights[i];
+		t->p3l = lights[i+1];
+		t->n1 = normals[0];
+		t->n2 = normals[i];
+		t->n3 = normals[i+1];
+		t->uv1 = in[0].uv;
+		t->uv2 = in[i].uv;
+		t->uv3 = in[i+1].uv;
+	}
+	return n_out;
+}
+
+//cuts the clip space line from a to b to the near plane and, when outcode says it reaches
+//past it, the guard band. returns 0 when none of it is left
+int clip_line(coord * a, coord * b, int outcode) {
+	coord planes[5] = {
+		{0.0, 0.0, 1.0, 0.0},
+		{1.0, 0.0, 0.0, guard_band},
+		{-1.0, 0.0, 0.0, guard_band},
+		{0.0, 1.0, 0.0, guard_band},
+		{0.0, -1.0, 0.0, guard_band},
+	};
+	int n_planes = outcode & clip_guard ? 5 : 1;
+
+	double t0 = 0.0;
+	double t1 = 1.0;
+	for (int p = 0; p < n_planes; p++) {
+		double da = coord_dot(planes[p], *a);
+		double db = coord_dot(planes[p], *b);
+		if (da < 0 && db < 0) {
+			return 0;
+		}
+		if (da < 0) {
+			t0 = fmax(t0, da/(da - db));
+		} else if (db < 0) {
+			t1 = fmin(t1, da/(da - db));
+		}
+	}
+	if (t0 >= t1) {
+		return 0;
+	}
+	coord direction = coord_sub(*b, *a);
+	coord start = coord_add(*a, coord_scale(direction, t0));
+	*b = coord_add(*a, coord_scale(direction, t1));
+	*a = start;
+	return 1;
+}
+
+//projects, lights and clips raw view space triangles, then draws them with draw_triangles,
+//timing projection and lighting separately when the scene collects stats. raw triangles are
+//already in view space, so only the projection is applied to find their outcodes
+void draw_raw_triangles(scene s, raw_triangle * raw, int n_triangles, rgb_color color) {
+	s.texture = NULL;
+	triangle * triangles = triangle_buffer_reserve(s.triangle_storage, n_triangles);
+
+	//per triangle the or of its vertex outcodes, and the and in the high bits. culled
+	//triangles are marked with -1
+	int mark = int_arena_mark(s.scene_arena);
+	int * outcodes = int_arena_alloc(s.scene_arena, n_triangles);
+
+	double transform_start = omp_get_wtime();
+	#pragma omp parallel for
+	for (int i = 0; i < n_triangles; i++) {
+		coord corners[3] = {raw[i].a, raw[i].b, raw[i].c};
+		int any = 0;
+		int all = clip_outside;
+		for (int k = 0; k < 3; k++) {
+			corners[k].w = 1.0;
+			int code = clip_outcode(s, matrix_vector_mul(s.projection, corners[k]));
+			any |= code;
+			all &= code;
+		}
+		outcodes[i] = any | (all << 8);
+
+		triangles[i].color = color;
+		if (!(any & (clip_near | clip_guard))) {
+			triangles[i].p1 = coord_to_canvas(s, coord_to_viewport(raw[i].a));
+			triangles[i].p2 = coord_to_canvas(s, coord_to_viewport(raw[i].b));
+			triangles[i].p3 = coord_to_canvas(s, coord_to_viewport(raw[i].c));
+		}
+	}
+
+	double lighting_start = omp_get_wtime();
+	#pragma omp parallel for
+	for (int i = 0; i < n_triangles; i++) {
+		coord normal_vec = get_triangle_normal(raw[i]);
+		if (outcodes[i] >> 8 || face_culled(s, normal_vec, raw[i].a)) {
+			outcodes[i] = -1;
+			continue;
+		}
+		triangles[i].n1 = normal_pack(normal_vec);
+		triangles[i].n2 = triangles[i].n1;
+		triangles[i].n3 = triangles[i].n1;
+		if (s.lights->shading != shade_vertex) {
+			triangles[i].p1l = triangles[i].p2l = triangles[i].p3l = 0;
+			continue;
+		}
+		triangles[i].p1l = get_lighting(s.lights, raw[i].a, normal_vec);
+		triangles[i].p2l = get_lighting(s.lights, raw[i].b, normal_vec);
+		triangles[i].p3l = get_lighting(s.lights, raw[i].c, normal_vec);
+	}
+
+	//survivors are packed down in order and the pieces of clipped triangles go after them
+	double clip_start = omp_get_wtime();
+	int n_kept = 0;
+	int n_clipped = 0;
+	for (int i = 0; i < n_triangles; i++) {
+		if (outcodes[i] == -1) {
+			continue;
+		}
+		if (outcodes[i] & (clip_near | clip_guard)) {
+			coord normal_vec = get_triangle_normal(raw[i]);
+			clip_vertex v[3] = {
+				{.position = matrix_vector_mul(s.projection, coord_create(raw[i].a.x, raw[i].a.y, raw[i].a.z, 1.0)), .light = triangles[i].p1l, .normal = normal_vec},
+				{.position = matrix_vector_mul(s.projection, coord_create(raw[i].b.x, raw[i].b.y, raw[i].b.z, 1.0)), .light = triangles[i].p2l, .normal = normal_vec},
+				{.position = matrix_vector_mul(s.projection, coord_create(raw[i].c.x, raw[i].c.y, raw[i].c.z, 1.0)), .light = triangles[i].p3l, .normal = normal_vec},
+			};
+			n_clipped = clip_triangle(v, outcodes[i], triangles[i], s.clipped_storage, n_clipped);
+			continue;
+		}
+		triangles[n_kept++] = triangles[i];
+	}
+	int_arena_rewind(s.scene_arena, mark);
+
+	if (n_clipped) {
+		triangles = triangle_buffer_reserve(s.triangle_storage, n_kept + n_clipped);
+		memcpy(&triangles[n_kept], s.clipped_storage->items, n_clipped*sizeof(triangle));
+	}
+
+	if (s.stats) {
+		double clip_end = omp_get_wtime();
+		s.stats->transform += lighting_start - transform_start + clip_end - clip_start;
+		s.stats->lighting += clip_start - lighting_start;
+	}
+
+	draw_triangles(s, triangles, n_kept + n_clipped);
+}
+
+//vertices as separate float x, y, z and w arrays so the per vertex stages run 8 vertices
+//per instruction. target_clones builds an avx2 and a baseline copy of each kernel and the
+//loader picks one for the cpu at startup
+typedef struct vertex_stream {
+	float * x;
+	float * y;
+	float * z;
+	float * w;
+	int n;
+	int capacity;
+} vertex_stream;
+
+void vertex_stream_reserve(vertex_stream * stream, int n) {
+	if (n > stream->capacity) {
+		free(stream->x);
+		free(stream->y);
+		free(stream->z);
+		free(stream->w);
+		stream->capacity = n > 2*stream->capacity ? n : 2*stream->capacity;
+		//padded to whole vectors so kernels never run off the end of an array
+		size_t bytes = ((stream->capacity + 7)/8)*8*sizeof(float);
+		stream->x = aligned_alloc(32, bytes);
+		stream->y = aligned_alloc(32, bytes);
+		stream->z = aligned_alloc(32, bytes);
+		stream->w = aligned_alloc(32, bytes);
+	}
+	stream->n = n;
+}
+
+void vertex_stream_free(vertex_stream * stream) {
+	free(stream->x);
+	free(stream->y);
+	free(stream->z);
+	free(stream->w);
+	free(stream);
+}
+
+//splits an xyz array into the stream, with w = 1
+__attribute__((target_clones("avx2", "default")))
+void vertex_stream_load(vertex_stream * stream, const float * xyz, int n) {
+	vertex_stream_reserve(stream, n);
+	float * restrict x = stream->x;
+	float * restrict y = stream->y;
+	float * restrict z = stream->z;
+	float * restrict w = stream->w;
+	#pragma omp parallel for simd
+	for (int i = 0; i < n; i++) {
+		x[i] = xyz[3*i];
+		y[i] = xyz[3*i + 1];
+		z[i] = xyz[3*i + 2];
+		w[i] = 1.0f;
+	}
+}
+
+//out = m*in for every vertex. in and out may be the same stream
+__attribute__((target_clones("avx2", "default")))
+void vertex_stream_transform(vertex_stream * out, const vertex_stream * in, matrix m) {
+	int n = in->n;
+	vertex_stream_reserve(out, n);
+	const float ax = m.a.x, ay = m.a.y, az = m.a.z, aw = m.a.w;
+	const float bx = m.b.x, by = m.b.y, bz = m.b.z, bw = m.b.w;
+	const float cx = m.c.x, cy = m.c.y, cz = m.c.z, cw = m.c.w;
+	const float dx = m.d.x, dy = m.d.y, dz = m.d.z, dw = m.d.w;
+	const float * ix = in->x;
+	const float * iy = in->y;
+	const float * iz = in->z;
+	const float * iw = in->w;
+	float * ox = out->x;
+	float * oy = out->y;
+	float * oz = out->z;
+	float * ow = out->w;
+
+	#pragma omp parallel for simd
+	for (int i = 0; i < n; i++) {
+		float x = ix[i];
+		float y = iy[i];
+		float z = iz[i];
+		float w = iw[i];
+		ox[i] = ax*x + bx*y + cx*z + dx*w;
+		oy[i] = ay*x + by*y + cy*z + dy*w;
+		oz[i] = az*x + bz*y + cz*z + dz*w;
+		ow[i] = aw*x + bw*y + cw*z + dw*w;
+	}
+}
+
+//out from offset on = m*v for the n vertices of an xyz array, with w taken as 1. out must
+//be reserved already. it runs on the calling thread, for callers giving each thread
+//a whole copy of a small mesh
+__attribute__((target_clones("avx2", "default")))
+void vertex_stream_transform_xyz(vertex_stream * out, int offset, const float * xyz, int n, matrix m) {
+	const float ax = m.a.x, ay = m.a.y, az = m.a.z, aw = m.a.w;
+	const float bx = m.b.x, by = m.b.y, bz = m.b.z, bw = m.b.w;
+	const float cx = m.c.x, cy = m.c.y, cz = m.c.z, cw = m.c.w;
+	const float dx = m.d.x, dy = m.d.y, dz = m.d.z, dw = m.d.w;
+	float * restrict ox = &out->x[offset];
+	float * restrict oy = &out->y[offset];
+	float * restrict oz = &out->z[offset];
+	float * restrict ow = &out->w[offset];
+
+	#pragma omp simd
+	for (int i = 0; i < n; i++) {
+		float x = xyz[3*i];
+		float y = xyz[3*i + 1];
+		float z = xyz[3*i + 2];
+		ox[i] = ax*x + bx*y + cx*z + dx;
+		oy[i] = ay*x + by*y + cy*z + dy;
+		oz[i] = az*x + bz*y + cz*z + dz;
+		ow[i] = aw*x + bw*y + cw*z + dw;
+	}
+}
+
+//out = in with x, y and z divided by w and w replaced with 1/w, which stays linear across
+//the screen. in is left alone so clipping can still use it
+__attribute__((target_clones("avx2", "default")))
+void vertex_stream_perspective_divide(vertex_stream * out, const vertex_stream * in) {
+	int n = in->n;
+	vertex_stream_reserve(out, n);
+	const float * restrict ix = in->x;
+	const float * restrict iy = in->y;
+	const float * restrict iz = in->z;
+	const float * restrict iw = in->w;
+	float * restrict ox = out->x;
+	float * restrict oy = out->y;
+	float * restrict oz = out->z;
+	float * restrict ow = out->w;
+	#pragma omp parallel for simd
+	for (int i = 0; i < n; i++) {
+		float inv_w = 1.0f/iw[i];
+		ox[i] = ix[i]*inv_w;
+		oy[i] = iy[i]*inv_w;
+		oz[i] = iz[i]*inv_w;
+		ow[i] = inv_w;
+	}
+}
+
+//a vertex after the per vertex stages of an indexed draw: where it landed on the canvas,
+//its position and normal in view space, its lighting and its clip outcode
+typedef struct transformed_vertex {
+	canvas_point point;
+	coord position;
+	coord normal;
+	int light;
+	int outcode;
+} transformed_vertex;
+
+typedef struct vertex_buffer {
+	transformed_vertex * items;
+	int capacity;
+} vertex_buffer;
+
+transformed_vertex * vertex_buffer_reserve(vertex_buffer * buffer, int n) {
+	if (n > buffer->capacity) {
+		buffer->capacity = n > 2*buffer->capacity ? n : 2*buffer->capacity;
+		buffer->items = realloc(buffer->items, buffer->capacity*sizeof(transformed_vertex));
+	}
+	return buffer->items;
+}
+
+coord face_normal(const transformed_vertex * a, const transformed_vertex * b, const transformed_vertex * c) {
+	coord l1 = coord_sub(b->position, a->position);
+	coord l2 = coord_sub(c->position, a->position);
+	coord output = {l1.y*l2.z - l1.z*l2.y, l1.z*l2.x - l1.x*l2.z, l1.x*l2.y - l1.y*l2.x, 0.0};
+	return output;
+}
+
+//an object space normal carried into view space by a copy's normal matrix
+coord normal_transform(const matrix * m, const float * n) {
+	coord result = {
+		m->a.x*n[0] + m->b.x*n[1] + m->c.x*n[2],
+		m->a.y*n[0] + m->b.y*n[1] + m->c.y*n[2],
+		m->a.z*n[0] + m->b.z*n[1] + m->c.z*n[2],
+		0.0,
+	};
+	return result;
+}
+
+//what draw_instanced works out once for each copy it draws
+typedef struct instance_transform {
+	matrix model_view;
+	matrix model_view_projection;
+	//takes object space normals to view space
+	matrix normal;
+	int copy;
+} instance_transform;
+
+//fills out with the triangle over the vertices base + t[0], t[1] and t[2] of an indexed
+//draw, as draw_indexed describes, given its unit face normal. uvs are indexed by t alone.
+//one crossing the near plane or the guard band is cut up into s.clipped_storage after
+//the n_clipped pieces already there instead, so n_clipped may be NULL only for one that
+//is not. returns 1 when out holds the triangle
+int assemble_triangle(scene s, const transformed_vertex * transformed, const vertex_stream * clip, const float * uvs, const unsigned int * t, int base, coord normal, int smooth, rgb_color color, triangle * out, int * n_clipped) {
+	const transformed_vertex * a = &transformed[base + t[0]];
+	const transformed_vertex * b = &transformed[base + t[1]];
+	const transformed_vertex * c = &transformed[base + t[2]];
+	out->color = color;
+	out->p1 = a->point;
+	out->p2 = b->point;
+	out->p3 = c->point;
+	coord normals[3] = {normal, normal, normal};
+	if (smooth) {
+		normals[0] = a->normal;
+		normals[1] = b->normal;
+		normals[2] = c->normal;
+		out->p1l = a->light;
+		out->p2l = b->light;
+		out->p3l = c->light;
+	} else if (s.lights->shading != shade_vertex) {
+		out->p1l = out->p2l = out->p3l = 0;
+	} else {
+		out->p1l = get_lighting(s.lights, a->position, normal);
+		out->p2l = get_lighting(s.lights, b->position, normal);
+		out->p3l = get_lighting(s.lights, c->position, normal);
+	}
+	out->n1 = normal_pack(normals[0]);
+	out->n2 = normal_pack(normals[1]);
+	out->n3 = normal_pack(normals[2]);
+	texture_coord corner_uvs[3] = {{0, 0}, {0, 0}, {0, 0}};
+	if (uvs) {
+		for (int k = 0; k < 3; k++) {
+			corner_uvs[k].u = uvs[2*t[k]];
+			corner_uvs[k].v = uvs[2*t[k] + 1];
+		}
+	}
+	out->uv1 = corner_uvs[0];
+	out->uv2 = corner_uvs[1];
+	out->uv3 = corner_uvs[2];
+
+	int outcode = a->outcode | b->outcode | c->outcode;
+	if (outcode & (clip_near | clip_guard)) {
+		int lights[3] = {out->p1l, out->p2l, out->p3l};
+		clip_vertex v[3];
+		for (int k = 0; k < 3; k++) {
+			int i = base + t[k];
+			clip_vertex corner = {
+				.position = coord_create(clip->x[i], clip->y[i], clip->z[i], clip->w[i]),
+				.light = lights[k],
+				.normal = normals[k],
+				.uv = corner_uvs[k],
+			};
+			v[k] = corner;
+		}
+		*n_clipped = clip_triangle(v, outcode, *out, s.clipped_storage, *n_clipped);
+		return 0;
+	}
+	return 1;
+}
+
+//the triangles of an indexed draw of one or more copies as assemble_triangles walks them.
+//triangle i of copy j uses the vertices from j*n_vertices on and is drawn in colors[j].
+//with copies given, its face normal is face_normals[i] carried into view space by copy j's
+//normal matrix and its colour colors[copies[j].copy]; without, the normal is worked out
+//from the transformed vertices and the colour is colors[0]
+typedef struct assembly {
+	const transformed_vertex * transformed;
+	const vertex_stream * clip;
+	const float * uvs;
+	const unsigned int * indices;
+	int n_triangles;
+	int n_vertices;
+	int smooth;
+	const instance_transform * copies;
+	const float * face_normals;
+	const rgb_color * colors;
+} assembly;
+
+#define assembly_dropped 0
+#define assembly_kept 1
+#define assembly_clipped 2
+
+//triangles per chunk of assemble_triangles' parallel passes
+#define assembly_chunk 1024
+
+//whether triangle i of copy j is dropped, for being out of view, facing the way s.cull
+//drops or having no area, clipped or kept. unless dropped, normal is its unit face normal
+int assembly_classify(const scene * s, const assembly * d, int j, int i, coord * normal) {
+	const unsigned int * t = &d->indices[3*i];
+	const transformed_vertex * a = &d->transformed[j*d->n_vertices + t[0]];
+	const transformed_vertex * b = &d->transformed[j*d->n_vertices + t[1]];
+	const transformed_vertex * c = &d->transformed[j*d->n_vertices + t[2]];
+	if (a->outcode & b->outcode & c->outcode & clip_outside) {
+		return assembly_dropped;
+	}
+	coord n = d->copies ? normal_transform(&d->copies[j].normal, &d->face_normals[3*i]) : face_normal(a, b, c);
+	if (coord_length(n) <= 1e-12 || face_culled(*s, n, a->position)) {
+		return assembly_dropped;
+	}
+	*normal = coord_unit(n);
+	return (a->outcode | b->outcode | c->outcode) & (clip_near | clip_guard) ? assembly_clipped : assembly_kept;
+}
+
+//assembles the triangles of n_copies copies into s.triangle_storage in parallel, keeping
+//their order. each chunk assembles and lights the triangles it keeps packed at the start of
+//its own slice of the buffer, counting them, and notes the few that need clipping in its
+//slice of a list. a prefix sum over the counts then says where each chunk's triangles
+//belong and they are moved down in order, each to no later than where it is. last the
+//noted ones are cut up and their pieces go after the rest. returns how many there are
+int assemble_triangles(scene s, const assembly * d, int n_copies) {
+	int n = n_copies*d->n_triangles;
+	int n_chunks = (n + assembly_chunk - 1)/assembly_chunk;
+	triangle * triangles = triangle_buffer_reserve(s.triangle_storage, n);
+	int mark = int_arena_mark(s.scene_arena);
+	int_arena_reserve(s.scene_arena, n + 2*n_chunks + 1);
+	int * chunk_offsets = int_arena_alloc(s.scene_arena, n_chunks + 1);
+	int * chunk_clipped = int_arena_alloc(s.scene_arena, n_chunks);
+	int * clipped = int_arena_alloc(s.scene_arena, n);
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int chunk = 0; chunk < n_chunks; chunk++) {
+		int first = chunk*assembly_chunk;
+		int end = first + assembly_chunk < n ? first + assembly_chunk : n;
+		int next = first;
+		int n_noted = 0;
+		//triangle i of copy j, stepped along rather than divided out for every triangle
+		int j = first/d->n_triangles;
+		int i = first % d->n_triangles;
+		for (int k = first; k < end; k++) {
+			coord normal;
+			int kind = assembly_classify(&s, d, j, i, &normal);
+			if (kind == assembly_kept) {
+				rgb_color color = d->copies ? d->colors[d->copies[j].copy] : d->colors[0];
+				assemble_triangle(s, d->transformed, d->clip, d->uvs, &d->indices[3*i], j*d->n_vertices, normal, d->smooth, color, &triangles[next++], NULL);
+			} else if (kind == assembly_clipped) {
+				clipped[first + n_noted++] = k;
+			}
+			if (++i == d->n_triangles) {
+				i = 0;
+				j++;
+			}
+		}
+		chunk_offsets[chunk + 1] = next - first;
+		chunk_clipped[chunk] = n_noted;
+	}
+
+	chunk_offsets[0] = 0;
+	for (int chunk = 0; chunk < n_chunks; chunk++) {
+		int kept = chunk_offsets[chunk + 1];
+		chunk_offsets[chunk + 1] = chunk_offsets[chunk] + kept;
+		if (chunk_offsets[chunk] != chunk*assembly_chunk) {
+			memmove(&triangles[chunk_offsets[chunk]], &triangles[chunk*assembly_chunk], kept*sizeof(triangle));
+		}
+	}
+	int n_kept = chunk_offsets[n_chunks];
+
+	int n_clipped = 0;
+	for (int chunk = 0; chunk < n_chunks; chunk++) {
+		for (int c = 0; c < chunk_clipped[chunk]; c++) {
+			int k = clipped[chunk*assembly_chunk + c];
+			int j = k/d->n_triangles;
+			int i = k % d->n_triangles;
+			coord normal;
+			assembly_classify(&s, d, j, i, &normal);
+			rgb_color color = d->copies ? d->colors[d->copies[j].copy] : d->colors[0];
+			triangle whole;
+			assemble_triangle(s, d->transformed, d->clip, d->uvs, &d->indices[3*i], j*d->n_vertices, normal, d->smooth, color, &whole, &n_clipped);
+		}
+	}
+	int_arena_rewind(s.scene_arena, mark);
+
+	if (n_clipped) {
+		triangles = triangle_buffer_reserve(s.triangle_storage, n_kept + n_clipped);
+		memcpy(&triangles[n_kept], s.clipped_storage->items, n_clipped*sizeof(triangle));
+	}
+	return n_kept + n_clipped;
+}
+
+//draws triangles indexing into a shared xyz vertex array placed in the world by model,
+//textured with s.texture when there is a uv array alongside.
+//every vertex is projected once however many triangles use it. with smooth set
+//the vertices are also lit once, using the area weighted average of the face normals around
+//them; otherwise each corner is lit with its face normal as draw_raw_triangles does.
+//triangles outside the frustum or facing the way s.cull drops are skipped before lighting
+void draw_indexed(scene s, const float * vertices, const float * uvs, int n_vertices, const unsigned int * indices, int n_triangles, matrix model, int smooth, rgb_color color) {
+	if (!uvs) {
+		s.texture = NULL;
+	}
+	transformed_vertex * transformed = vertex_buffer_reserve(s.vertex_storage, n_vertices);
+
+	//the whole transform is concatenated once per draw. lighting needs view space
+	//positions, so model-view is applied as well as the full model-view-projection
+	matrix model_view = matrix_matrix_mul(s.view, model);
+	matrix model_view_projection = matrix_matrix_mul(s.projection, model_view);
+
+	double transform_start = omp_get_wtime();
+	vertex_stream * view = s.view_stream;
+	vertex_stream * clip = s.clip_stream;
+	vertex_stream * screen = s.screen_stream;
+	vertex_stream_load(view, vertices, n_vertices);
+	vertex_stream_transform(clip, view, model_view_projection);
+	vertex_stream_transform(view, view, model_view);
+	vertex_stream_perspective_divide(screen, clip);
+
+	//vertices behind the near plane or past the guard band have no usable canvas point,
+	//the triangles using them go through the clipper instead
+	#pragma omp parallel for
+	for (int i = 0; i < n_vertices; i++) {
+		transformed[i].position = coord_create(view->x[i], view->y[i], view->z[i], 0.0);
+		transformed[i].outcode = clip_outcode(s, coord_create(clip->x[i], clip->y[i], clip->z[i], clip->w[i]));
+		if (transformed[i].outcode & (clip_near | clip_guard)) {
+			transformed[i].point = create_point(0, 0, view->z[i]);
+		} else {
+			transformed[i].point = create_point(canvas_snap(screen->x[i]), canvas_snap(screen->y[i]), view->z[i]);
+		}
+		transformed[i].normal = coord_create(0.0, 0.0, 0.0, 0.0);
+	}
+
+	double lighting_start = omp_get_wtime();
+	if (smooth) {
+		//the unnormalized cross product is twice the face area, so summing it weights by area
+		for (int i = 0; i < n_triangles; i++) {
+			const unsigned int * t = &indices[3*i];
+			coord normal = face_normal(&transformed[t[0]], &transformed[t[1]], &transformed[t[2]]);
+			for (int k = 0; k < 3; k++) {
+				transformed[t[k]].normal = coord_add(transformed[t[k]].normal, normal);
+			}
+		}
+
+		int per_pixel = s.lights->shading != shade_vertex;
+		#pragma omp parallel for
+		for (int i = 0; i < n_vertices; i++) {
+			if (coord_length(transformed[i].normal) > 1e-12) {
+				transformed[i].normal = coord_unit(transformed[i].normal);
+				transformed[i].light = per_pixel ? 0 : get_lighting(s.lights, transformed[i].position, transformed[i].normal);
+			} else {
+				transformed[i].light = 0;
+			}
+		}
+	}
+
+	//triangle assembly. triangles with no area are dropped, they have no normal to light
+	assembly d = {transformed, clip, uvs, indices, n_triangles, n_vertices, smooth, NULL, NULL, &color};
+	int n_assembled = assemble_triangles(s, &d, 1);
+
+	if (s.stats) {
+		double lighting_end = omp_get_wtime();
+		s.stats->transform += lighting_start - transform_start;
+		s.stats->lighting += lighting_end - lighting_start;
+	}
+
+	draw_triangles(s, s.triangle_storage->items, n_assembled);
+}
+
+//draws edges, pairs of indices into a shared xyz vertex array placed by model, as lines
+//depth tested against what is drawn already, so faces in front of an edge hide it.
+//the vertices are projected once; edges wholly outside the frustum are dropped and those
+//crossing the near plane or the guard band are cut before the divide
+void draw_indexed_edges(scene s, const float * vertices, int n_vertices, const unsigned int * edges, int n_edges, matrix model, rgb_color color, int smooth) {
+	line_segment * lines = line_buffer_reserve(s.line_storage, n_edges);
+	matrix model_view_projection = matrix_matrix_mul(s.projection, matrix_matrix_mul(s.view, model));
+
+	double transform_start = omp_get_wtime();
+	vertex_stream * clip = s.clip_stream;
+	vertex_stream * screen = s.screen_stream;
+	vertex_stream_load(s.view_stream, vertices, n_vertices);
+	vertex_stream_transform(clip, s.view_stream, model_view_projection);
+	vertex_stream_perspective_divide(screen, clip);
+
+	//each vertex is snapped once, however many edges share it
+	int_arena * arena = s.scene_arena;
+	int mark = int_arena_mark(arena);
+	int_arena_reserve(arena, 3*n_vertices);
+	int * outcodes = int_arena_alloc(arena, n_vertices);
+	int * snapped = int_arena_alloc(arena, 2*n_vertices);
+	#pragma omp parallel for
+	for (int i = 0; i < n_vertices; i++) {
+		outcodes[i] = clip_outcode(s, coord_create(clip->x[i], clip->y[i], clip->z[i], clip->w[i]));
+		if (!(outcodes[i] & (clip_near | clip_guard))) {
+			snapped[2*i] = canvas_snap(screen->x[i]);
+			snapped[2*i+1] = canvas_snap(screen->y[i]);
+		}
+	}
+
+	//edges outside one plane are dropped, and those crossing the near plane or the guard
+	//band are cut. w is the view space depth canvas points carry as z
+	int n_lines = 0;
+	for (int i = 0; i < n_edges; i++) {
+		unsigned int i0 = edges[2*i];
+		unsigned int i1 = edges[2*i+1];
+		int outcode = outcodes[i0] | outcodes[i1];
+		if (outcodes[i0] & outcodes[i1] & clip_outside) {
+			continue;
+		}
+		line_segment * l = &lines[n_lines];
+		if (outcode & (clip_near | clip_guard)) {
+			coord a = coord_create(clip->x[i0], clip->y[i0], clip->z[i0], clip->w[i0]);
+			coord b = coord_create(clip->x[i1], clip->y[i1], clip->z[i1], clip->w[i1]);
+			if (!clip_line(&a, &b, outcode)) {
+				continue;
+			}
+			l->a = create_point(canvas_snap(a.x/a.w), canvas_snap(a.y/a.w), a.w);
+			l->b = create_point(canvas_snap(b.x/b.w), canvas_snap(b.y/b.w), b.w);
+		} else {
+			l->a = create_point(snapped[2*i0], snapped[2*i0+1], clip->w[i0]);
+			l->b = create_point(snapped[2*i1], snapped[2*i1+1], clip->w[i1]);
+		}
+		l->color = color;
+		n_lines++;
+	}
+	int_arena_rewind(arena, mark);
+
+	if (s.stats) {
+		s.stats->transform += omp_get_wtime() - transform_start;
+	}
+
+	draw_lines(s, lines, n_lines, smooth);
+}
+
+//meshes are a float xyz vertex array and a triangle index array. binary meshes are mapped
+//straight from disk and used in place, so loading one costs a page fault per page touched
+
+#define mesh_magic "RMSH"
+#define mesh_version 2
+#define mesh_has_uvs 1
+
+//a binary mesh file is this header followed by n_vertices*3 floats, n_vertices*2 texture
+//coordinates when flags has mesh_has_uvs, and n_triangles*3 unsigned ints, all little
+//endian. version 1 files end the header before flags and have no texture coordinates
+typedef struct mesh_file_header {
+	char magic[4];
+	unsigned int version;
+	unsigned int n_vertices;
+	unsigned int n_triangles;
+	unsigned int flags;
+} mesh_file_header;
+
+typedef struct mesh {
+	const float * vertices;
+	const float * uvs;
+	const unsigned int * indices;
+	int n_vertices;
+	int n_triangles;
+
+	//either the file mapping backing a binary mesh or the heap block holding a parsed one
+	void * mapping;
+	size_t mapping_size;
+	void * storage;
+
+	//object space bounding box, for culling whole meshes
+	coord low;
+	coord high;
+
+	//each edge once as a pair of vertex indices, built by mesh_edges when first drawn
+	unsigned int * edges;
+	int n_edges;
+
+	//object space face normals, unnormalized, and their sums around each vertex. built
+	//by mesh_normals when the mesh is first drawn instanced
+	float * face_normals;
+	float * vertex_normals;
+} mesh;
+
+void mesh_free(mesh * m) {
+	free(m->edges);
+	free(m->face_normals);
+	free(m->vertex_normals);
+	if (m->mapping) {
+		munmap(m->mapping, m->mapping_size);
+	}
+	free(m->storage);
+	free(m);
+}
+
+mesh * mesh_load_binary(const char * path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return NULL;
+	}
+	struct stat info;
+	size_t v1_header_size = offsetof(mesh_file_header, flags);
+	if (fstat(fd, &info) != 0 || (size_t)info.st_size < v1_header_size) {
+		fprintf(stderr, "%s is not a mesh file\n", path);
+		close(fd);
+		return NULL;
+	}
+	void * mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		fprintf(stderr, "Could not map %s\n", path);
+		return NULL;
+	}
+
+	//flags is only read once the version says it is there and the file is long enough to
+	//hold it. the counts are kept small enough that 5 floats a vertex and 3 indices a
+	//triangle still count in an int, and must then add up to the size of the file
+	const mesh_file_header * header = mapping;
+	int valid = memcmp(header->magic, mesh_magic, 4) == 0 && header->version >= 1 && header->version <= mesh_version;
+	size_t header_size = header->version == 1 ? v1_header_size : sizeof(mesh_file_header);
+	valid = valid && (size_t)info.st_size >= header_size;
+	valid = valid && header->n_vertices <= INT_MAX/5 && header->n_triangles <= INT_MAX/3;
+	int has_uvs = valid && header->version > 1 && (header->flags & mesh_has_uvs);
+	size_t expected = header_size + (has_uvs ? 5 : 3)*sizeof(float)*(size_t)header->n_vertices + 3*sizeof(unsigned int)*(size_t)header->n_triangles;
+	if (!valid || expected != (size_t)info.st_size) {
+		fprintf(stderr, "%s is not a version 1 to %d mesh file\n", path, mesh_version);
+		munmap(mapping, info.st_size);
+		return NULL;
+	}
+	madvise(mapping, info.st_size, MADV_WILLNEED);
+
+	mesh * m = calloc(1, sizeof(mesh));
+	m->mapping = mapping;
+	m->mapping_size = info.st_size;
+	m->n_vertices = header->n_vertices;
+	m->n_triangles = header->n_triangles;
+	m->vertices = (const float *)((const char *)mapping + header_size);
+	m->uvs = has_uvs ? m->vertices + 3*m->n_vertices : NULL;
+	m->indices = (const unsigned int *)(m->vertices + (has_uvs ? 5 : 3)*m->n_vertices);
+
+	for (int i = 0; i < 3*m->n_triangles; i++) {
+		if (m->indices[i] >= (unsigned int)m->n_vertices) {
+			fprintf(stderr, "%s has an index out of range\n", path);
+			mesh_free(m);
+			return NULL;
+		}
+	}
+	return m;
+}
+
+int mesh_save_binary(mesh * m, const char * path) {
+	FILE * file = fopen(path, "wb");
+	if (!file) {
+		fprintf(stderr, "Could not open %s for writing\n", path);
+		return -1;
+	}
+	mesh_file_header header;
+	memcpy(header.magic, mesh_magic, 4);
+	header.version = mesh_version;
+	header.n_vertices = m->n_vertices;
+	header.n_triangles = m->n_triangles;
+	header.flags = m->uvs ? mesh_has_uvs : 0;
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(m->vertices, sizeof(float), 3*m->n_vertices, file);
+	if (m->uvs) {
+		fwrite(m->uvs, sizeof(float), 2*m->n_vertices, file);
+	}
+	fwrite(m->indices, sizeof(unsigned int), 3*m->n_triangles, file);
+	int result = ferror(file) ? -1 : 0;
+	if (fclose(file) != 0) {
+		result = -1;
+	}
+	return result;
+}
+
+//reads the v, vt and f lines of a wavefront obj, fanning polygons into triangles. without
+//texture coordinates vertices are shared exactly as the file shares them. with them each
+//distinct position and texture coordinate pair becomes a vertex, found through a hash
+//table. normal indices on faces are skipped
+mesh * mesh_load_obj(const char * path) {
+	FILE * file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return NULL;
+	}
+	long size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+	if (size < 0 || fseek(file, 0, SEEK_SET) != 0) {
+		fprintf(stderr, "Could not read %s\n", path);
+		fclose(file);
+		return NULL;
+	}
+	char * text = malloc((size_t)size + 1);
+	size_t read = text ? fread(text, 1, size, file) : 0;
+	fclose(file);
+	if (!text || read != (size_t)size) {
+		fprintf(stderr, "Could not read %s\n", path);
+		free(text);
+		return NULL;
+	}
+	text[read] = '\0';
+
+	//count first so the arrays are allocated once
+	int n_positions = 0;
+	int n_texture_coords = 0;
+	int n_triangles = 0;
+	int n_corners = 0;
+	for (char * line = text; line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+		if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t')) {
+			n_positions++;
+		} else if (line[0] == 'v' && line[1] == 't' && (line[2] == ' ' || line[2] == '\t')) {
+			n_texture_coords++;
+		} else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t')) {
+			int corners = 0;
+			for (char * c = line + 1; *c && *c != '\n'; ) {
+				while (*c == ' ' || *c == '\t' || *c == '\r') c++;
+				if (!*c || *c == '\n') break;
+				corners++;
+				while (*c && *c != ' ' && *c != '\t' && *c != '\n' && *c != '\r') c++;
+			}
+			n_triangles += corners > 2 ? corners - 2 : 0;
+			n_corners += corners;
+		}
+	}
+
+	//a textured file can have at most a vertex per face corner
+	int has_uvs = n_texture_coords > 0;
+	int max_vertices = has_uvs ? (n_corners > n_positions ? n_corners : n_positions) : n_positions;
+	float * positions = malloc(3*sizeof(float)*(size_t)(n_positions + 1));
+	float * texture_coords = malloc(2*sizeof(float)*(size_t)(n_texture_coords + 1));
+	char * storage = malloc((has_uvs ? 5 : 3)*sizeof(float)*(size_t)max_vertices + 3*sizeof(unsigned int)*(size_t)n_triangles);
+	float * vertices = (float *)storage;
+	float * uvs = has_uvs ? vertices + 3*max_vertices : NULL;
+	unsigned int * indices = (unsigned int *)(vertices + (has_uvs ? 5 : 3)*max_vertices);
+
+	int table_size = 1;
+	while (table_size < 2*max_vertices) {
+		table_size *= 2;
+	}
+	//slots hold a vertex index or -1, and each vertex keeps the pair it was made from
+	int * table = NULL;
+	long long * vertex_keys = NULL;
+	if (has_uvs) {
+		table = malloc(sizeof(int)*table_size);
+		memset(table, 0xff, sizeof(int)*table_size);
+		vertex_keys = malloc(sizeof(long long)*max_vertices);
+	}
+
+	int position = 0;
+	int texture_coord_index = 0;
+	int n_vertices = has_uvs ? 0 : n_positions;
+	int triangle_index = 0;
+	int valid = 1;
+
+	for (char * line = text; line && valid; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+		if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t')) {
+			char * c = line + 1;
+			for (int k = 0; k < 3; k++) {
+				positions[3*position + k] = strtof(c, &c);
+			}
+			position++;
+		} else if (line[0] == 'v' && line[1] == 't' && (line[2] == ' ' || line[2] == '\t')) {
+			char * c = line + 2;
+			for (int k = 0; k < 2; k++) {
+				texture_coords[2*texture_coord_index + k] = strtof(c, &c);
+			}
+			texture_coord_index++;
+		} else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t')) {
+			char * c = line + 1;
+			int corner = 0;
+			unsigned int first = 0;
+			unsigned int previous = 0;
+			while (1) {
+				while (*c == ' ' || *c == '\t' || *c == '\r') c++;
+				if (!*c || *c == '\n') break;
+				long index = strtol(c, &c, 10);
+				//negative indices count back from the last vertex read so far
+				index = index < 0 ? position + index : index - 1;
+				long uv_index = -1;
+				if (*c == '/' && c[1] != '/') {
+					uv_index = strtol(c + 1, &c, 10);
+					uv_index = uv_index < 0 ? texture_coord_index + uv_index : uv_index - 1;
+				}
+				if (index < 0 || index >= n_positions || uv_index < -1 || uv_index >= n_texture_coords) {
+					valid = 0;
+					break;
+				}
+				while (*c && *c != ' ' && *c != '\t' && *c != '\n' && *c != '\r') c++;
+
+				if (has_uvs) {
+					long long key = index*(long long)(n_texture_coords + 1) + uv_index + 1;
+					unsigned int slot = (unsigned int)(((unsigned long long)key*0x9e3779b97f4a7c15ull) >> 32) & (table_size - 1);
+					while (table[slot] >= 0 && vertex_keys[table[slot]] != key) {
+						slot = (slot + 1) & (table_size - 1);
+					}
+					if (table[slot] < 0) {
+						table[slot] = n_vertices;
+						vertex_keys[n_vertices] = key;
+						n_vertices++;
+					}
+					index = table[slot];
+				}
+
+				if (corner == 0) {
+					first = index;
+				} else if (corner >= 2) {
+					indices[3*triangle_index] = first;
+					indices[3*triangle_index + 1] = previous;
+					indices[3*triangle_index + 2] = index;
+					triangle_index++;
+				}
+				previous = index;
+				corner++;
+			}
+		}
+	}
+	free(text);
+	free(table);
+
+	if (!valid) {
+		fprintf(stderr, "%s has a face index out of range\n", path);
+		free(vertex_keys);
+		free(positions);
+		free(texture_coords);
+		free(storage);
+		return NULL;
+	}
+	//vertices are filled in only now, since a face may use positions and texture
+	//coordinates given further down the file
+	if (has_uvs) {
+		for (int i = 0; i < n_vertices; i++) {
+			long long index = vertex_keys[i]/(n_texture_coords + 1);
+			long long uv_index = vertex_keys[i] % (n_texture_coords + 1) - 1;
+			memcpy(&vertices[3*i], &positions[3*index], 3*sizeof(float));
+			uvs[2*i] = uv_index >= 0 ? texture_coords[2*uv_index] : 0.0f;
+			uvs[2*i + 1] = uv_index >= 0 ? texture_coords[2*uv_index + 1] : 0.0f;
+		}
+	} else {
+		memcpy(vertices, positions, 3*sizeof(float)*(size_t)n_positions);
+	}
+	free(vertex_keys);
+	free(positions);
+	free(texture_coords);
+
+	mesh * m = calloc(1, sizeof(mesh));
+	m->storage = storage;
+	m->vertices = vertices;
+	m->uvs = uvs;
+	m->indices = indices;
+	m->n_vertices = n_vertices;
+	m->n_triangles = triangle_index;
+	return m;
+}
+
+void mesh_bounds(mesh * m, coord * low, coord * high) {
+	*low = coord_create(INFINITY, INFINITY, INFINITY, 0.0);
+	*high = coord_create(-INFINITY, -INFINITY, -INFINITY, 0.0);
+	for (int i = 0; i < m->n_vertices; i++) {
+		const float * v = &m->vertices[3*i];
+		low->x = v[0] < low->x ? v[0] : low->x;
+		low->y = v[1] < low->y ? v[1] : low->y;
+		low->z = v[2] < low->z ? v[2] : low->z;
+		high->x = v[0] > high->x ? v[0] : high->x;
+		high->y = v[1] > high->y ? v[1] : high->y;
+		high->z = v[2] > high->z ? v[2] : high->z;
+	}
+}
+
+mesh * mesh_load(const char * path) {
+	int length = strlen(path);
+	mesh * m;
+	if (length > 4 && strcmp(&path[length - 4], ".obj") == 0) {
+		m = mesh_load_obj(path);
+	} else {
+		m = mesh_load_binary(path);
+	}
+	if (m) {
+		mesh_bounds(m, &m->low, &m->high);
+	}
+	return m;
+}
+
+//draws the mesh placed by model, smooth shaded, unless its bounding box is out of view
+void draw_mesh(scene s, mesh * m, matrix model, rgb_color color) {
+	matrix model_view_projection = matrix_matrix_mul(s.projection, matrix_matrix_mul(s.view, model));
+	if (box_outside_frustum(s, model_view_projection, m->low, m->high)) {
+		return;
+	}
+	draw_indexed(s, m->vertices, m->uvs, m->n_vertices, m->indices, m->n_triangles, model, 1, color);
+}
+
+//the edges of the mesh's triangles, each once however many triangles share it, as pairs
+//of vertex indices. they are found on first use by hashing the index pairs and kept with
+//the mesh, so drawing its wireframe again costs only the lines
+const unsigned int * mesh_edges(mesh * m, int * n_edges) {
+	if (!m->edges && m->n_triangles > 0) {
+		size_t capacity = 1;
+		while (capacity < 6*(size_t)m->n_triangles) {
+			capacity *= 2;
+		}
+		unsigned long long * keys = malloc(capacity*sizeof(unsigned long long));
+		for (size_t i = 0; i < capacity; i++) {
+			keys[i] = ~0ULL;
+		}
+		m->edges = malloc(6*(size_t)m->n_triangles*sizeof(unsigned int));
+		m->n_edges = 0;
+		for (int i = 0; i < 3*m->n_triangles; i++) {
+			unsigned int a = m->indices[i];
+			unsigned int b = m->indices[i % 3 == 2 ? i - 2 : i + 1];
+			if (a == b) {
+				continue;
+			}
+			unsigned long long key = a < b ? (unsigned long long)a << 32 | b : (unsigned long long)b << 32 | a;
+			size_t slot = (size_t)((key*0x9e3779b97f4a7c15ULL) >> 17) & (capacity - 1);
+			while (keys[slot] != ~0ULL && keys[slot] != key) {
+				slot = (slot + 1) & (capacity - 1);
+			}
+			if (keys[slot] == key) {
+				continue;
+			}
+			keys[slot] = key;
+			m->edges[2*m->n_edges] = a;
+			m->edges[2*m->n_edges+1] = b;
+			m->n_edges++;
+		}
+		free(keys);
+	}
+	*n_edges = m->n_edges;
+	return m->edges;
+}
+
+enum {wireframe_none = 0, wireframe_hard = 1, wireframe_smooth = 2};
+
+//draws the edges of the mesh placed by model as lines, unless its bounding box is out of view
+void draw_mesh_edges(scene s, mesh * m, matrix model, rgb_color color, int smooth) {
+	matrix model_view_projection = matrix_matrix_mul(s.projection, matrix_matrix_mul(s.view, model));
+	if (box_outside_frustum(s, model_view_projection, m->low, m->high)) {
+		return;
+	}
+	int n_edges;
+	const unsigned int * edges = mesh_edges(m, &n_edges);
+	draw_indexed_edges(s, m->vertices, m->n_vertices, edges, n_edges, model, color, smooth);
+}
+
+//the face normals of the mesh's triangles in object space and their sums at the vertices,
+//the part of smooth shading that is the same for every copy of the mesh. the cross product
+//is twice the face area, so the sums weight by area as draw_indexed's do
+void mesh_normals(mesh * m) {
+	if (m->face_normals) {
+		return;
+	}
+	m->face_normals = malloc(3*((size_t)m->n_triangles + 1)*sizeof(float));
+	m->vertex_normals = calloc(3*((size_t)m->n_vertices + 1), sizeof(float));
+	for (int i = 0; i < m->n_triangles; i++) {
+		const unsigned int * t = &m->indices[3*i];
+		const float * a = &m->vertices[3*t[0]];
+		const float * b = &m->vertices[3*t[1]];
+		const float * c = &m->vertices[3*t[2]];
+		double l1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+		double l2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+		double normal[3] = {l1[1]*l2[2] - l1[2]*l2[1], l1[2]*l2[0] - l1[0]*l2[2], l1[0]*l2[1] - l1[1]*l2[0]};
+		for (int k = 0; k < 3; k++) {
+			m->face_normals[3*i + k] = (float)normal[k];
+			for (int corner = 0; corner < 3; corner++) {
+				m->vertex_normals[3*t[corner] + k] += (float)normal[k];
+			}
+		}
+	}
+}
+
+typedef struct instance_buffer {
+	instance_transform * items;
+	int capacity;
+} instance_buffer;
+
+instance_transform * instance_buffer_reserve(instance_buffer * buffer, int n) {
+	if (n > buffer->capacity) {
+		buffer->capacity = n > 2*buffer->capacity ? n : 2*buffer->capacity;
+		buffer->items = realloc(buffer->items, buffer->capacity*sizeof(instance_transform));
+	}
+	return buffer->items;
+}
+
+//the copies of an instanced draw go through the pipeline together, as many at a time as
+//make up this many vertices
+#define instance_batch_vertices 8192
+
+//draws a copy of the mesh for each of the n model matrices, smooth shaded like draw_mesh
+//and each in its own colour. the face normals and their sums at the vertices are kept with
+//the mesh and carried into view space by each copy's cofactor matrix, so a copy costs its
+//vertex transform, lighting and triangles. copies whose box is out of view are dropped,
+//and the rest are transformed, assembled and drawn in batches rather than one at a time,
+//which is what makes many copies of a small mesh cheap
+void draw_instanced(scene s, mesh * m, const matrix * models, const rgb_color * colors, int n) {
+	if (!m->uvs) {
+		s.texture = NULL;
+	}
+	if (m->n_vertices == 0 || m->n_triangles == 0) {
+		return;
+	}
+	mesh_normals(m);
+	int n_vertices = m->n_vertices;
+	int batch_copies = instance_batch_vertices/n_vertices > 1 ? instance_batch_vertices/n_vertices : 1;
+	instance_transform * copies = instance_buffer_reserve(s.instance_storage, batch_copies);
+	int per_pixel = s.lights->shading != shade_vertex;
+
+	for (int next = 0; next < n;) {
+		double transform_start = omp_get_wtime();
+		int n_copies = 0;
+		for (; next < n && n_copies < batch_copies; next++) {
+			instance_transform * copy = &copies[n_copies];
+			copy->model_view = matrix_matrix_mul(s.view, models[next]);
+			copy->model_view_projection = matrix_matrix_mul(s.projection, copy->model_view);
+			if (box_outside_frustum(s, copy->model_view_projection, m->low, m->high)) {
+				continue;
+			}
+			copy->normal = matrix_cofactor(copy->model_view);
+			copy->copy = next;
+			n_copies++;
+		}
+		if (n_copies == 0) {
+			continue;
+		}
+
+		int batch_vertices = n_copies*n_vertices;
+		transformed_vertex * transformed = vertex_buffer_reserve(s.vertex_storage, batch_vertices);
+		vertex_stream * view = s.view_stream;
+		vertex_stream * clip = s.clip_stream;
+		vertex_stream * screen = s.screen_stream;
+		vertex_stream_reserve(view, batch_vertices);
+		vertex_stream_reserve(clip, batch_vertices);
+		#pragma omp parallel for
+		for (int j = 0; j < n_copies; j++) {
+			vertex_stream_transform_xyz(view, j*n_vertices, m->vertices, n_vertices, copies[j].model_view);
+			vertex_stream_transform_xyz(clip, j*n_vertices, m->vertices, n_vertices, copies[j].model_view_projection);
+		}
+		vertex_stream_perspective_divide(screen, clip);
+
+		#pragma omp parallel for
+		for (int i = 0; i < batch_vertices; i++) {
+			transformed[i].position = coord_create(view->x[i], view->y[i], view->z[i], 0.0);
+			transformed[i].outcode = clip_outcode(s, coord_create(clip->x[i], clip->y[i], clip->z[i], clip->w[i]));
+			if (transformed[i].outcode & (clip_near | clip_guard)) {
+				transformed[i].point = create_point(0, 0, view->z[i]);
+			} else {
+				transformed[i].point = create_point(canvas_snap(screen->x[i]), canvas_snap(screen->y[i]), view->z[i]);
+			}
+		}
+
+		double lighting_start = omp_get_wtime();
+		#pragma omp parallel for collapse(2)
+		for (int j = 0; j < n_copies; j++) {
+			for (int k = 0; k < n_vertices; k++) {
+				transformed_vertex * v = &transformed[j*n_vertices + k];
+				coord normal = normal_transform(&copies[j].normal, &m->vertex_normals[3*k]);
+				if (coord_length(normal) > 1e-12) {
+					v->normal = coord_unit(normal);
+					v->light = per_pixel ? 0 : get_lighting(s.lights, v->position, v->normal);
+				} else {
+					v->normal = coord_create(0.0, 0.0, 0.0, 0.0);
+					v->light = 0;
+				}
+			}
+		}
+
+		assembly d = {transformed, clip, m->uvs, m->indices, m->n_triangles, n_vertices, 1, copies, m->face_normals, colors};
+		int n_assembled = assemble_triangles(s, &d, n_copies);
+
+		if (s.stats) {
+			double lighting_end = omp_get_wtime();
+			s.stats->transform += lighting_start - transform_start;
+			s.stats->lighting += lighting_end - lighting_start;
+		}
+
+		draw_triangles(s, s.triangle_storage->items, n_assembled);
+	}
+}
+
+//a unit cube centred on the origin, each face with vertices of its own so it shades flat
+mesh * mesh_box() {
+	float * vertices = malloc(6*4*3*sizeof(float) + 6*2*3*sizeof(unsigned int));
+	unsigned int * indices = (unsigned int *)&vertices[6*4*3];
+	for (int face = 0; face < 6; face++) {
+		//u cross v points out of the face
+		int axis = face/2;
+		double side = face & 1 ? -0.5 : 0.5;
+		double normal[3] = {0.0, 0.0, 0.0};
+		double u[3] = {0.0, 0.0, 0.0};
+		double v[3] = {0.0, 0.0, 0.0};
+		normal[axis] = side;
+		u[(axis + (face & 1 ? 2 : 1)) % 3] = 0.5;
+		v[(axis + (face & 1 ? 1 : 2)) % 3] = 0.5;
+		for (int corner = 0; corner < 4; corner++) {
+			double su = corner == 1 || corner == 2 ? 1.0 : -1.0;
+			double sv = corner >= 2 ? 1.0 : -1.0;
+			for (int k = 0; k < 3; k++) {
+				vertices[3*(4*face + corner) + k] = (float)(normal[k] + su*u[k] + sv*v[k]);
+			}
+		}
+		unsigned int quad[6] = {0, 1, 2, 0, 2, 3};
+		for (int k = 0; k < 6; k++) {
+			indices[6*face + k] = 4*face + quad[k];
+		}
+	}
+
+	mesh * m = calloc(1, sizeof(mesh));
+	m->storage = vertices;
+	m->vertices = vertices;
+	m->indices = indices;
+	m->n_vertices = 6*4;
+	m->n_triangles = 6*2;
+	mesh_bounds(m, &m->low, &m->high);
+	return m;
+}
+
+//a world of mesh instances, each a mesh placed by a model matrix of its own, for scenes
+//holding far more objects than are ever in view. world_build puts the instances in a
+//bounding volume hierarchy over their world space boxes, which draw_world walks to drop
+//whole groups of them before any of their vertices are touched
+typedef struct mesh_instance {
+	mesh * m;
+	matrix model;
+	rgb_color color;
+
+	//the mesh's box placed by model, boxed again in world space
+	coord low;
+	coord high;
+} mesh_instance;
+
+//a node covers the instances order[first] to order[first + count - 1]. interior nodes
+//have their two children at child and child + 1, leaves a child of 0
+typedef struct bvh_node {
+	coord low;
+	coord high;
+	int first;
+	int count;
+	int child;
+} bvh_node;
+
+#define bvh_leaf_size 4
+
+//draw_world hands visible instances to draw_instanced this many at a time. instances still
+//waiting are not in the coarse depth yet and can hide nothing, so it is kept small
+#define world_batch 32
+
+typedef struct world {
+	mesh_instance * instances;
+	int n_instances;
+	int capacity;
+
+	//built by world_build and dropped again by world_add
+	bvh_node * nodes;
+	int n_nodes;
+	int * order;
+	int * stack;
+
+	//visible instances of one mesh waiting to be drawn together by draw_instanced
+	mesh * batch_mesh;
+	matrix * batch_models;
+	rgb_color * batch_colors;
+	int n_batch;
+
+	//what the last draw_world did with the instances: drawn, outside the frustum, or
+	//hidden behind ones drawn before them
+	int drawn;
+	int outside;
+	int occluded;
+} world;
+
+world * world_create() {
+	return calloc(1, sizeof(world));
+}
+
+void world_free(world * w) {
+	free(w->instances);
+	free(w->nodes);
+	free(w->order);
+	free(w->stack);
+	free(w->batch_models);
+	free(w->batch_colors);
+	free(w);
+}
+
+//adds the mesh placed by model. the mesh is borrowed and has to outlive the world
+void world_add(world * w, mesh * m, matrix model, rgb_color color) {
+	if (w->n_instances == w->capacity) {
+		w->capacity = w->capacity ? 2*w->capacity : 64;
+		w->instances = realloc(w->instances, w->capacity*sizeof(mesh_instance));
+	}
+	mesh_instance * instance = &w->instances[w->n_instances++];
+	instance->m = m;
+	instance->model = model;
+	instance->color = color;
+	instance->low = coord_create(INFINITY, INFINITY, INFINITY, 1.0);
+	instance->high = coord_create(-INFINITY, -INFINITY, -INFINITY, 1.0);
+	for (int i = 0; i < 8; i++) {
+		coord corner = matrix_vector_mul(model, coord_create(i & 1 ? m->high.x : m->low.x, i & 2 ? m->high.y : m->low.y, i & 4 ? m->high.z : m->low.z, 1.0));
+		instance->low = coord_create(fmin(instance->low.x, corner.x), fmin(instance->low.y, corner.y), fmin(instance->low.z, corner.z), 1.0);
+		instance->high = coord_create(fmax(instance->high.x, corner.x), fmax(instance->high.y, corner.y), fmax(instance->high.z, corner.z), 1.0);
+	}
+	w->n_nodes = 0;
+}
+
+double coord_axis(coord c, int axis) {
+	return axis == 0 ? c.x : axis == 1 ? c.y : c.z;
+}
+
+//boxes the instances of the node and splits them in two at the middle of their centres
+//along the longest side, or down the middle of order when they all fall on one side, so
+//each child always has fewer. returns 0 for a leaf and 1 when it made the two children
+int bvh_build_node(world * w, int node) {
+	bvh_node * n = &w->nodes[node];
+	int first = n->first;
+	int count = n->count;
+	n->child = 0;
+	n->low = coord_create(INFINITY, INFINITY, INFINITY, 1.0);
+	n->high = coord_create(-INFINITY, -INFINITY, -INFINITY, 1.0);
+	coord centre_low = n->low;
+	coord centre_high = n->high;
+	for (int i = first; i < first + count; i++) {
+		mesh_instance * instance = &w->instances[w->order[i]];
+		n->low = coord_create(fmin(n->low.x, instance->low.x), fmin(n->low.y, instance->low.y), fmin(n->low.z, instance->low.z), 1.0);
+		n->high = coord_create(fmax(n->high.x, instance->high.x), fmax(n->high.y, instance->high.y), fmax(n->high.z, instance->high.z), 1.0);
+		coord centre = coord_scale(coord_add(instance->low, instance->high), 0.5);
+		centre_low = coord_create(fmin(centre_low.x, centre.x), fmin(centre_low.y, centre.y), fmin(centre_low.z, centre.z), 1.0);
+		centre_high = coord_create(fmax(centre_high.x, centre.x), fmax(centre_high.y, centre.y), fmax(centre_high.z, centre.z), 1.0);
+	}
+	if (count <= bvh_leaf_size) {
+		return 0;
+	}
+
+	int axis = 0;
+	for (int k = 1; k < 3; k++) {
+		double extent = coord_axis(centre_high, k) - coord_axis(centre_low, k);
+		axis = extent > coord_axis(centre_high, axis) - coord_axis(centre_low, axis) ? k : axis;
+	}
+	double split = coord_axis(centre_low, axis) + coord_axis(centre_high, axis);
+	int middle = first;
+	for (int i = first; i < first + count; i++) {
+		mesh_instance * instance = &w->instances[w->order[i]];
+		if (coord_axis(instance->low, axis) + coord_axis(instance->high, axis) < split) {
+			int swap = w->order[i];
+			w->order[i] = w->order[middle];
+			w->order[middle] = swap;
+			middle++;
+		}
+	}
+	if (middle == first || middle == first + count) {
+		middle = first + count/2;
+	}
+
+	int child = w->n_nodes;
+	w->n_nodes += 2;
+	n->child = child;
+	w->nodes[child].first = first;
+	w->nodes[child].count = middle - first;
+	w->nodes[child + 1].first = middle;
+	w->nodes[child + 1].count = first + count - middle;
+	return 1;
+}
+
+void world_build(world * w) {
+	free(w->nodes);
+	free(w->order);
+	free(w->stack);
+	//a binary tree with leaves of at least one instance has fewer than twice as many nodes
+	int max_nodes = w->n_instances > 0 ? 2*w->n_instances - 1 : 1;
+	w->nodes = malloc(max_nodes*sizeof(bvh_node));
+	w->stack = malloc(max_nodes*sizeof(int));
+	w->order = malloc((w->n_instances > 0 ? w->n_instances : 1)*sizeof(int));
+	for (int i = 0; i < w->n_instances; i++) {
+		w->order[i] = i;
+	}
+
+	//built from a stack of nodes still to split rather than by recursion, since a tree over
+	//badly spread instances can be as deep as there are instances. the second child is
+	//pushed first so nodes are split, and numbered, depth first
+	w->n_nodes = 1;
+	w->nodes[0].first = 0;
+	w->nodes[0].count = w->n_instances;
+	int depth = 0;
+	w->stack[depth++] = 0;
+	while (depth > 0) {
+		int node = w->stack[--depth];
+		if (bvh_build_node(w, node)) {
+			w->stack[depth++] = w->nodes[node].child + 1;
+			w->stack[depth++] = w->nodes[node].child;
+		}
+	}
+	if (!w->batch_models) {
+		w->batch_models = malloc(world_batch*sizeof(matrix));
+		w->batch_colors = malloc(world_batch*sizeof(rgb_color));
+	}
+}
+
+void world_flush(scene s, world * w) {
+	if (w->n_batch) {
+		draw_instanced(s, w->batch_mesh, w->batch_models, w->batch_colors, w->n_batch);
+		w->n_batch = 0;
+	}
+}
+
+//whether a box transformed by m into clip space is hidden behind what is already drawn:
+//its nearest point is behind the farthest depth of every coarse depth block its screen
+//rectangle touches. a box reaching past the near plane is never hidden
+int box_occluded(scene s, matrix m, coord low, coord high) {
+	double x0 = INFINITY;
+	double x1 = -INFINITY;
+	double y0 = INFINITY;
+	double y1 = -INFINITY;
+	double nearest = 0.0;
+	for (int i = 0; i < 8; i++) {
+		coord corner = matrix_vector_mul(m, coord_create(i & 1 ? high.x : low.x, i & 2 ? high.y : low.y, i & 4 ? high.z : low.z, 1.0));
+		if (corner.z <= 0) {
+			return 0;
+		}
+		double w = 1/corner.w;
+		x0 = fmin(x0, corner.x*w);
+		x1 = fmax(x1, corner.x*w);
+		y0 = fmin(y0, corner.y*w);
+		y1 = fmax(y1, corner.y*w);
+		nearest = fmax(nearest, w);
+	}
+
+	double px0 = fmax(floor(x0) + s.screen_width/2, 0.0);
+	double px1 = fmin(floor(x1) + s.screen_width/2, s.screen_width - 1.0);
+	double py0 = fmax(floor(y0) + s.screen_height/2, 0.0);
+	double py1 = fmin(floor(y1) + s.screen_height/2, s.screen_height - 1.0);
+	if (px0 > px1 || py0 > py1) {
+		return 0;
+	}
+	int bx0 = (int)px0/depth_block;
+	int bx1 = (int)px1/depth_block;
+	int by0 = (int)py0/depth_block;
+	int by1 = (int)py1/depth_block;
+	for (int by = by0; by <= by1; by++) {
+		for (int bx = bx0; bx <= bx1; bx++) {
+			if (s.coarse_depth[by*s.coarse_width + bx] < nearest) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+//draws the world's instances, walking its hierarchy front to back. a node outside the
+//frustum is dropped whole, as is one hidden behind the coarse depth of what was drawn
+//before it, and drawing nearest first is what lets the occlusion test drop anything. the
+//cost so goes with what is in view rather than with the size of the world. visible
+//instances sharing a mesh are drawn together in small batches
+void draw_world(scene s, world * w) {
+	w->drawn = 0;
+	w->outside = 0;
+	w->occluded = 0;
+	if (w->n_instances == 0) {
+		return;
+	}
+	if (w->n_nodes == 0) {
+		world_build(w);
+	}
+	matrix view_projection = matrix_matrix_mul(s.projection, s.view);
+
+	int depth = 0;
+	w->stack[depth++] = 0;
+	while (depth > 0) {
+		bvh_node * n = &w->nodes[w->stack[--depth]];
+		if (box_outside_frustum(s, view_projection, n->low, n->high)) {
+			w->outside += n->count;
+			continue;
+		}
+		if (box_occluded(s, view_projection, n->low, n->high)) {
+			w->occluded += n->count;
+			continue;
+		}
+		if (n->child) {
+			//the farther child goes on the stack first so the nearer one is walked first
+			bvh_node * a = &w->nodes[n->child];
+			bvh_node * b = &w->nodes[n->child + 1];
+			double a_depth = matrix_vector_mul(s.view, coord_scale(coord_add(a->low, a->high), 0.5)).z;
+			double b_depth = matrix_vector_mul(s.view, coord_scale(coord_add(b->low, b->high), 0.5)).z;
+			w->stack[depth++] = a_depth < b_depth ? n->child + 1 : n->child;
+			w->stack[depth++] = a_depth < b_depth ? n->child : n->child + 1;
+			continue;
+		}
+		for (int i = n->first; i < n->first + n->count; i++) {
+			mesh_instance * instance = &w->instances[w->order[i]];
+			if (n->count > 1 && box_outside_frustum(s, view_projection, instance->low, instance->high)) {
+				w->outside++;
+			} else if (n->count > 1 && box_occluded(s, view_projection, instance->low, instance->high)) {
+				w->occluded++;
+			} else {
+				if (w->n_batch == world_batch || (w->n_batch && w->batch_mesh != instance->m)) {
+					world_flush(s, w);
+				}
+				w->batch_mesh = instance->m;
+				w->batch_models[w->n_batch] = instance->model;
+				w->batch_colors[w->n_batch] = instance->color;
+				w->n_batch++;
+				w->drawn++;
+			}
+		}
+	}
+	world_flush(s, w);
+}
+
+//model matrix that fits a mesh into a half unit box centred two units in front of the origin
+matrix mesh_fit_in_view(mesh * m) {
+	coord low = m->low;
+	coord high = m->high;
+	double extent = high.x - low.x;
+	extent = high.y - low.y > extent ? high.y - low.y : extent;
+	extent = high.z - low.z > extent ? high.z - low.z : extent;
+	double scale = extent > 0 ? 0.5/extent : 1.0;
+	matrix centre = matrix_translate(-0.5*(low.x + high.x), -0.5*(low.y + high.y), -0.5*(low.z + high.z));
+	return matrix_matrix_mul(matrix_translate(0.0, 0.0, 2.0), matrix_matrix_mul(matrix_scaling(scale, scale, scale), centre));
+}
+
+void pyramid(scene s, matrix model) {
+	rgb_color red = {244, 23, 43};
+
+	float points [4*3] = {
+		0.0, -0.25, 2.0,
+		-0.25, -0.25, 2.3,
+		0.25, -0.25, 2.3,
+		0.0, 0.25, 2.15,
+	};
+
+	enum {FRONT = 0, LEFT = 1, RIGHT = 2, TOP = 3};
+	//the faces are not wound consistently, so none are culled
+	s.cull = cull_none;
+	unsigned int triangles [4*3] = {
+		LEFT, FRONT, RIGHT,
+		RIGHT, FRONT, TOP,
+		LEFT, FRONT, TOP,
+		TOP, RIGHT, LEFT,
+	}; 
+
+	draw_indexed(s, points, NULL, 4, triangles, 4, model, 0, red);
+
+}
+
+void tirangle_cube(scene s, matrix model) {
+	rgb_color red = {244, 23, 43};
+
+	float points [8*3] = {
+		-0.25, -0.25, 2.0,
+		0.25, -0.25, 2.0,
+		-0.25, 0.25, 2.0,
+		0.25, 0.25, 2.0,
+		-0.25, -0.25, 2.5,
+		0.25, -0.25, 2.5,
+		-0.25, 0.25, 2.5,
+		0.25, 0.25, 2.5,
+	};
+
+	enum {BLF = 0, BRF = 1, TLF = 2, TRF = 3, BLB = 4, BRB = 5, TLB = 6, TRB = 7};
+	//the faces are not wound consistently, so none are culled
+	s.cull = cull_none;
+	unsigned int triangles [12*3] = {
+		BLF, BRF, TRF,
+		TRF, TLF, BLF,
+		BLB, BRB, TRB,
+		TRB, TLB, BLB,
+		BRF, BLF, BLB,
+		BLB, BRB, BRF,
+		TRF, TLF, TLB,
+		TLB, TRB, TRF,
+		BRF, TRB, BRB,
+		TRF, TRB, BRF,
+		BLF, TLB, BLB,
+		TLF, TLB, BLF,
+	}; 
+
+	draw_indexed(s, points, NULL, 8, triangles, 12, model, 0, red);
+
+}
+
+//the scene arena is sized up front from the resolution to hold the tile bins. anything
+//bigger grows it once and it then stays at its high water mark, so later frames do not
+//touch the heap
+void scene_create_arenas(scene * s) {
+	int tiles = ((s->screen_width + tile_size - 1)/tile_size)*((s->screen_height + tile_size - 1)/tile_size);
+
+	s->scene_arena = int_arena_create(8*tiles + 10000);
+	s->n_threads = omp_get_max_threads();
+	s->triangle_storage = calloc(1, sizeof(triangle_buffer));
+	s->vertex_storage = calloc(1, sizeof(vertex_buffer));
+	s->view_stream = calloc(1, sizeof(vertex_stream));
+	s->clip_stream = calloc(1, sizeof(vertex_stream));
+	s->screen_stream = calloc(1, sizeof(vertex_stream));
+	s->clipped_storage = calloc(1, sizeof(triangle_buffer));
+	s->setup_storage = calloc(1, sizeof(setup_buffer));
+	s->line_storage = calloc(1, sizeof(line_buffer));
+	s->instance_storage = calloc(1, sizeof(instance_buffer));
+	s->stats = NULL;
+}
+
+void scene_free_arenas(scene * s) {
+	int_arena_free(s->scene_arena);
+	free(s->triangle_storage->items);
+	free(s->triangle_storage);
+	free(s->vertex_storage->items);
+	free(s->vertex_storage);
+	vertex_stream_free(s->view_stream);
+	vertex_stream_free(s->clip_stream);
+	vertex_stream_free(s->screen_stream);
+	free(s->clipped_storage->items);
+	free(s->clipped_storage);
+	free(s->setup_storage->records);
+	free(s->setup_storage->planes);
+	free(s->setup_storage);
+	free(s->line_storage->items);
+	free(s->line_storage);
+	free(s->instance_storage->items);
+	free(s->instance_storage);
+}
+
+//a scene rendering at width x height with its own buffers, arenas and camera. any number
+//can exist at once; the viewport keeps default_viewport_width and takes its height from the aspect
+scene scene_create(int width, int height) {
+	scene s;
+	s.screen_width = width;
+	s.screen_height = height;
+	size_t buffer_bytes = (((size_t)width*height*sizeof(unsigned int) + 63)/64)*64;
+	s.screen = aligned_alloc(64, buffer_bytes);
+	s.depth_buffer = aligned_alloc(64, buffer_bytes);
+	s.normal_buffer = NULL;
+	s.coarse_width = (width + depth_block - 1)/depth_block;
+	s.coarse_depth = calloc(s.coarse_width*((height + depth_block - 1)/depth_block), sizeof(double));
+	scene_create_arenas(&s);
+	fill_kernel_init();
+
+	s.clip_x0 = 0;
+	s.clip_y0 = 0;
+	s.clip_x1 = width;
+	s.clip_y1 = height;
+	s.cull = cull_back;
+	s.wireframe = wireframe_none;
+	s.reference_fill = 0;
+	s.coverage = NULL;
+	s.samples = 1;
+	s.sample_color = NULL;
+	s.sample_depth = NULL;
+	s.sample_normal = NULL;
+	s.texture = NULL;
+	s.lights = malloc(sizeof(light_rig));
+	light_rig_init(s.lights);
+	s.viewport_width = default_viewport_width;
+	s.viewport_height = default_viewport_width*height/width;
+	s.view = matrix_identity();
+	s.projection = matrix_perspective(canvas_depth, s.viewport_width, s.viewport_height, width, height, near_plane);
+	return s;
+}
+
+//sets how the scene is shaded. the normals of the g-buffer, per pixel and per sample when
+//multisampling, are only kept while it is shade_deferred
+void scene_set_shading(scene * s, int shading) {
+	s->lights->shading = shading;
+	free(s->normal_buffer);
+	free(s->sample_normal);
+	s->normal_buffer = NULL;
+	s->sample_normal = NULL;
+	if (shading == shade_deferred) {
+		size_t bytes = (((size_t)s->screen_width*s->screen_height*sizeof(unsigned int) + 63)/64)*64;
+		s->normal_buffer = aligned_alloc(64, bytes);
+		if (s->samples > 1) {
+			s->sample_normal = aligned_alloc(64, bytes*s->samples);
+		}
+	}
+}
+
+//switches the scene to 1, 4 or 8 samples per pixel, replacing its sample buffers
+void scene_set_samples(scene * s, int samples) {
+	assert(samples == 1 || samples == 4 || samples == 8);
+	free(s->sample_color);
+	free(s->sample_depth);
+	s->samples = samples;
+	s->sample_color = NULL;
+	s->sample_depth = NULL;
+	if (samples > 1) {
+		size_t bytes = (((size_t)s->screen_width*s->screen_height*samples*sizeof(unsigned int) + 63)/64)*64;
+		s->sample_color = aligned_alloc(64, bytes);
+		s->sample_depth = aligned_alloc(64, bytes);
+	}
+	scene_set_shading(s, s->lights->shading);
+}
+
+void scene_free(scene * s) {
+	scene_free_arenas(s);
+	free(s->screen);
+	free(s->depth_buffer);
+	free(s->normal_buffer);
+	free(s->sample_color);
+	free(s->sample_depth);
+	free(s->sample_normal);
+	free(s->coarse_depth);
+	free(s->lights);
+}
+
+void scene_begin_frame(scene s) {
+	int_arena_reset(s.scene_arena);
+}
+
+void scene_print_arena_stats(scene s) {
+	int_arena_print_stats("scene arena", s.scene_arena);
+}
+
+//sets n words to value. where there are streaming stores they are used, so clearing a
+//buffer far bigger than the cache does not read it all in first
+void clear_words(unsigned int * words, unsigned int value, int n) {
+	int i = 0;
+#ifdef __SSE2__
+	for (; i < n && ((size_t)&words[i] & 15); i++) {
+		words[i] = value;
+	}
+	__m128i v = _mm_set1_epi32(value);
+	for (; i + 4 <= n; i += 4) {
+		_mm_stream_si128((__m128i *)&words[i], v);
+	}
+	_mm_sfence();
+#endif
+	for (; i < n; i++) {
+		words[i] = value;
+	}
+}
+
+//clears colour and depth a row at a time, so each thread finishes with both of its rows
+//while they are still open. a cleared depth_value is all zero bits in either format.
+//multisampled scenes clear their samples, the screen is rewritten when they are resolved
+void clear_scene(scene * s, rgb_color background_color) {
+	double start = omp_get_wtime();
+	unsigned int background = pixel_pack(background_color);
+	int width = s->screen_width;
+	int n = s->samples;
+	unsigned int * color = n > 1 ? s->sample_color : s->screen;
+	unsigned int * depth = n > 1 ? (unsigned int *)s->sample_depth : (unsigned int *)s->depth_buffer;
+	#pragma omp parallel for
+	for (int y = 0; y < s->screen_height; y++) {
+		clear_words(&color[(size_t)y*width*n], background, width*n);
+		clear_words(&depth[(size_t)y*width*n], 0, width*n);
+	}
+	int n_blocks = s->coarse_width*((s->screen_height + depth_block - 1)/depth_block);
+	for (int i = 0; i < n_blocks; i++) {
+		s->coarse_depth[i] = 0;
+	}
+	if (s->stats) {
+		s->stats->clear += omp_get_wtime() - start;
+	}
+}
+
+//the lit colour of a g-buffer entry of pixel x, y
+unsigned int deferred_light(const scene * s, int x, int y, depth_value depth, unsigned int albedo, unsigned int normal) {
+	coord position = pixel_view_position(s, x, y, depth_decode(depth));
+	double intensity = normal != normal_none ? light_intensity(s->lights, position, normal_decode(normal)) : s->lights->ambient;
+	int scale = (int)(intensity*color_max);
+	unsigned char rgb[4];
+	memcpy(rgb, &albedo, 4);
+	return pixel_pack(color_scale(create_color(rgb[0], rgb[1], rgb[2]), scale < color_max ? scale : color_max - 1));
+}
+
+//the lighting pass of deferred shading, run once over the visible pixels. cleared pixels
+//have a depth of zero. multisampled, the samples of a pixel one triangle covered share
+//its albedo and normal, and a run of samples sharing them is lit once
+void light_deferred(scene * s) {
+	double start = omp_get_wtime();
+	int n = s->samples;
+	unsigned int * color = n > 1 ? s->sample_color : s->screen;
+	depth_value * depth = n > 1 ? s->sample_depth : s->depth_buffer;
+	unsigned int * normal = n > 1 ? s->sample_normal : s->normal_buffer;
+	#pragma omp parallel for schedule(dynamic, 8)
+	for (int y = 0; y < s->screen_height; y++) {
+		for (int x = 0; x < s->screen_width; x++) {
+			size_t base = ((size_t)y*s->screen_width + x)*n;
+			unsigned int albedo = 0;
+			unsigned int lit = 0;
+			for (int k = 0; k < n; k++) {
+				size_t i = base + k;
+				if (depth[i] == 0) {
+					continue;
+				}
+				if (k == 0 || color[i] != albedo || normal[i] != normal[i-1] || depth[i-1] == 0) {
+					albedo = color[i];
+					lit = deferred_light(s, x, y, depth[i], albedo, normal[i]);
+				}
+				color[i] = lit;
+			}
+		}
+	}
+	if (s->stats) {
+		s->stats->lighting += omp_get_wtime() - start;
+	}
+}
+
+//averages each pixel's samples into the screen and keeps the nearest of their depths in
+//the depth buffer, for whatever is drawn over the finished frame. a pixel's samples are a
+//run of 4 or 8 words, summed with a 16 bit lane per channel
+void resolve_samples(scene * s) {
+	double start = omp_get_wtime();
+	int n = s->samples;
+	int shift = n == 8 ? 3 : 2;
+	#pragma omp parallel for
+	for (int y = 0; y < s->screen_height; y++) {
+		size_t row = (size_t)y*s->screen_width;
+		for (int x = 0; x < s->screen_width; x++) {
+			const unsigned int * colors = &s->sample_color[(row + x)*n];
+			const depth_value * depths = &s->sample_depth[(row + x)*n];
+#ifdef __SSE2__
+			__m128i zero = _mm_setzero_si128();
+			__m128i sum = zero;
+			for (int k = 0; k < n; k += 4) {
+				__m128i v = _mm_load_si128((const __m128i *)&colors[k]);
+				sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero)));
+			}
+			sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+			sum = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(n/2)), shift);
+			s->screen[row + x] = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+#else
+			unsigned int pixel = 0;
+			for (int c = 0; c < 4; c++) {
+				unsigned int channel = n/2;
+				for (int k = 0; k < n; k++) {
+					channel += (colors[k] >> 8*c) & 0xff;
+				}
+				pixel |= (channel >> shift) << 8*c;
+			}
+			s->screen[row + x] = pixel;
+#endif
+			depth_value nearest = depths[0];
+			for (int k = 1; k < n; k++) {
+				nearest = depths[k] > nearest ? depths[k] : nearest;
+			}
+			s->depth_buffer[row + x] = nearest;
+		}
+	}
+	if (s->stats) {
+		s->stats->resolve += omp_get_wtime() - start;
+	}
+}
+
+//finishes a frame once everything is drawn: the lighting pass with deferred shading, then
+//the resolve when multisampling
+void scene_end_frame(scene * s) {
+	if (s->lights->shading == shade_deferred) {
+		light_deferred(s);
+	}
+	if (s->samples > 1) {
+		resolve_samples(s);
+	}
+}
+
+//converts screen row y to packed rgb
+__attribute__((target_clones("avx2", "default")))
+void screen_row_rgb(scene s, int y, unsigned char * rgb) {
+	const unsigned char * pixels = (const unsigned char *)&s.screen[y*s.screen_width];
+	for (int x = 0; x < s.screen_width; x++) {
+		rgb[3*x] = pixels[4*x];
+		rgb[3*x + 1] = pixels[4*x + 1];
+		rgb[3*x + 2] = pixels[4*x + 2];
+	}
+}
+
+//copies the screen into a top down rgb image, the format frames are handed on in
+void present_rgb(scene s, unsigned char * rgb) {
+	double start = omp_get_wtime();
+	int row_bytes = 3*s.screen_width;
+	#pragma omp parallel for
+	for (int y = 0; y < s.screen_height; y++) {
+		screen_row_rgb(s, y, &rgb[(s.screen_height - 1 - y)*row_bytes]);
+	}
+	if (s.stats) {
+		s.stats->present += omp_get_wtime() - start;
+	}
+}
+
+//image output. the screen is stored bottom row first like the gl texture it feeds,
+//so rows are converted to rgb and written in reverse to get a top down image
+
+int write_ppm(scene s, FILE * file) {
+	unsigned char * rgb = malloc(3*s.screen_width);
+	fprintf(file, "P6\n%d %d\n255\n", s.screen_width, s.screen_height);
+	for (int y = s.screen_height - 1; y >= 0; y--) {
+		screen_row_rgb(s, y, rgb);
+		fwrite(rgb, 1, 3*s.screen_width, file);
+	}
+	free(rgb);
+	return ferror(file) ? -1 : 0;
+}
+
+int write_raw(scene s, FILE * file) {
+	unsigned char * rgb = malloc(3*s.screen_width);
+	for (int y = s.screen_height - 1; y >= 0; y--) {
+		screen_row_rgb(s, y, rgb);
+		fwrite(rgb, 1, 3*s.screen_width, file);
+	}
+	free(rgb);
+	return ferror(file) ? -1 : 0;
+}
+
+//png without a zlib dependency: the image data goes out as stored (uncompressed) deflate
+//blocks, which every decoder accepts and costs nothing to produce
+typedef struct png_writer {
+	FILE * file;
+	unsigned int crc_table[256];
+	unsigned int crc;
+	unsigned int adler_a;
+	unsigned int adler_b;
+	long long deflate_left;
+	int block_left;
+} png_writer;
+
+void png_put(png_writer * w, const unsigned char * data, int n) {
+	for (int i = 0; i < n; i++) {
+		w->crc = w->crc_table[(w->crc ^ data[i]) & 0xff] ^ (w->crc >> 8);
+	}
+	fwrite(data, 1, n, w->file);
+}
+
+void png_put_u32(png_writer * w, unsigned int v) {
+	unsigned char bytes[4] = {v >> 24, v >> 16, v >> 8, v};
+	png_put(w, bytes, 4);
+}
+
+void png_chunk_begin(png_writer * w, const char * type, unsigned int length) {
+	unsigned char bytes[4] = {length >> 24, length >> 16, length >> 8, length};
+	fwrite(bytes, 1, 4, w->file);
+	w->crc = 0xffffffff;
+	png_put(w, (const unsigned char *)type, 4);
+}
+
+void png_chunk_end(png_writer * w) {
+	unsigned int crc = w->crc ^ 0xffffffff;
+	unsigned char bytes[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+	fwrite(bytes, 1, 4, w->file);
+}
+
+void png_deflate_put(png_writer * w, const unsigned char * data, int n) {
+	while (n > 0) {
+		if (w->block_left == 0) {
+			int size = w->deflate_left < 65535 ? (int)w->deflate_left : 65535;
+			unsigned char header[5] = {w->deflate_left == size, size & 0xff, size >> 8, ~size & 0xff, (~size >> 8) & 0xff};
+			png_put(w, header, 5);
+			w->block_left = size;
+		}
+		int count = n < w->block_left ? n : w->block_left;
+		for (int i = 0; i < count; i++) {
+			w->adler_a = (w->adler_a + data[i]) % 65521;
+			w->adler_b = (w->adler_b + w->adler_a) % 65521;
+		}
+		png_put(w, data, count);
+		w->block_left -= count;
+		w->deflate_left -= count;
+		data += count;
+		n -= count;
+	}
+}
+
+int write_png(scene s, FILE * file) {
+	png_writer w;
+	w.file = file;
+	for (unsigned int i = 0; i < 256; i++) {
+		unsigned int c = i;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		w.crc_table[i] = c;
+	}
+
+	const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	fwrite(signature, 1, 8, file);
+
+	png_chunk_begin(&w, "IHDR", 13);
+	png_put_u32(&w, s.screen_width);
+	png_put_u32(&w, s.screen_height);
+	const unsigned char format[5] = {8, 2, 0, 0, 0}; //8 bit rgb, no interlace
+	png_put(&w, format, 5);
+	png_chunk_end(&w);
+
+	long long raw_size = (long long)s.screen_height*(1 + 3*s.screen_width);
+	long long blocks = (raw_size + 65534)/65535;
+	png_chunk_begin(&w, "IDAT", (unsigned int)(2 + 5*blocks + raw_size + 4));
+	const unsigned char zlib_header[2] = {0x78, 0x01};
+	png_put(&w, zlib_header, 2);
+	w.adler_a = 1;
+	w.adler_b = 0;
+	w.deflate_left = raw_size;
+	w.block_left = 0;
+	const unsigned char no_filter = 0;
+	unsigned char * rgb = malloc(3*s.screen_width);
+	for (int y = s.screen_height - 1; y >= 0; y--) {
+		screen_row_rgb(s, y, rgb);
+		png_deflate_put(&w, &no_filter, 1);
+		png_deflate_put(&w, rgb, 3*s.screen_width);
+	}
+	free(rgb);
+	png_put_u32(&w, (w.adler_b << 16) | w.adler_a);
+	png_chunk_end(&w);
+
+	png_chunk_begin(&w, "IEND", 0);
+	png_chunk_end(&w);
+	return ferror(file) ? -1 : 0;
+}
+
+//the file name of a frame. a path holding a %d, optionally with a 0 flag and a width as in
+//frame%04d.ppm, is numbered with the frame. the path is not a printf format: every other
+//character, % included, is copied as it is, and a second %d is refused. with tag_size set
+//the scene's resolution goes in front of the extension, so several scenes rendered to
+//one path land in out_256x256.png, out_3840x2160.png and so on. returns -1 for a bad path
+int frame_name(char * name, size_t size, scene s, const char * path, int frame, int tag_size) {
+	size_t n = 0;
+	int numbered = 0;
+	for (const char * c = path; *c; c++) {
+		const char * spec = c + 1;
+		int zero = *c == '%' && *spec == '0';
+		spec += zero;
+		int width = 0;
+		while (*c == '%' && *spec >= '0' && *spec <= '9') {
+			width = width < 1000 ? 10*width + (*spec - '0') : width;
+			spec++;
+		}
+		if (*c != '%' || *spec != 'd') {
+			if (n + 1 < size) {
+				name[n++] = *c;
+			}
+			continue;
+		}
+		if (numbered || width > 64) {
+			fprintf(stderr, "Bad frame path %s, it may hold one %%d for the frame number\n", path);
+			return -1;
+		}
+		char number[80];
+		snprintf(number, sizeof(number), zero ? "%0*d" : "%*d", width, frame);
+		for (const char * digit = number; *digit; digit++) {
+			if (n + 1 < size) {
+				name[n++] = *digit;
+			}
+		}
+		numbered = 1;
+		c = spec;
+	}
+	name[n] = 0;
+	if (tag_size) {
+		char * extension = strrchr(name, '.');
+		char * directory = strrchr(name, '/');
+		if (!extension || (directory && directory > extension)) {
+			extension = name + strlen(name);
+		}
+		char rest[4096];
+		snprintf(rest, sizeof(rest), "%s", extension);
+		snprintf(extension, size - (extension - name), "_%dx%d%s", s.screen_width, s.screen_height, rest);
+	}
+	return 0;
+}
+
+//writes a frame to path, picking the format from the extension. "-" streams raw rgb to
+//stdout, anything else is named by frame_name
+int write_frame(scene s, const char * path, int frame, int tag_size) {
+	if (strcmp(path, "-") == 0) {
+		return write_raw(s, stdout);
+	}
+
+	char name[4096];
+	if (frame_name(name, sizeof(name), s, path, frame, tag_size) != 0) {
+		return -1;
+	}
+	FILE * file = fopen(name, "wb");
+	if (!file) {
+		fprintf(stderr, "Could not open %s for writing\n", name);
+		return -1;
+	}
+
+	int length = strlen(name);
+	int result;
+	if (length > 4 && strcmp(&name[length - 4], ".png") == 0) {
+		result = write_png(s, file);
+	} else if (length > 4 && strcmp(&name[length - 4], ".rgb") == 0) {
+		result = write_raw(s, file);
+	} else {
+		result = write_ppm(s, file);
+	}
+	if (fclose(file) != 0) {
+		result = -1;
+	}
+	return result;
+}
+
+//benchmark workloads. everything is generated from a fixed seed so runs compare across
+//builds, and placed in front of the camera: x/z within +-0.5 and y/z within +-0.28
+
+unsigned int bench_random_state = 12345;
+
+double bench_random(double low, double high) {
+	bench_random_state = bench_random_state*1664525 + 1013904223;
+	return low + (high - low)*((bench_random_state >> 8)/16777216.0);
+}
+
+raw_triangle bench_triangle(double x, double y, double z, double size) {
+	raw_triangle t;
+	t.a = coord_create(x + bench_random(-size, size), y + bench_random(-size, size), z + bench_random(-0.1, 0.1), 0.0);
+	t.b = coord_create(x + bench_random(-size, size), y + bench_random(-size, size), z + bench_random(-0.1, 0.1), 0.0);
+	t.c = coord_create(x + bench_random(-size, size), y + bench_random(-size, size), z + bench_random(-0.1, 0.1), 0.0);
+	return t;
+}
+
+//n triangles of a few dozen pixels scattered over the screen at mixed depths
+int bench_random_triangles(raw_triangle * out, int n) {
+	for (int i = 0; i < n; i++) {
+		double z = bench_random(2.0, 10.0);
+		out[i] = bench_triangle(bench_random(-0.45, 0.45)*z, bench_random(-0.25, 0.25)*z, z, 0.02*z);
+	}
+	return n;
+}
+
+//a handful of triangles that each cover most of the screen, bound by fill rate
+int bench_large_triangles(raw_triangle * out, int n) {
+	int count = n < 64 ? n : 64;
+	for (int i = 0; i < count; i++) {
+		double z = 2.0 + 0.01*i;
+		out[i] = bench_triangle(0.0, 0.0, z, 0.6*z);
+	}
+	return count;
+}
+
+//n triangles covering a pixel or two, bound by setup
+int bench_tiny_triangles(raw_triangle * out, int n) {
+	for (int i = 0; i < n; i++) {
+		double z = bench_random(2.0, 10.0);
+		out[i] = bench_triangle(bench_random(-0.45, 0.45)*z, bench_random(-0.25, 0.25)*z, z, 0.0008*z);
+	}
+	return n;
+}
+
+//full screen quads stacked back to front, the worst case for overdraw
+int bench_overdraw(raw_triangle * out, int n) {
+	int layers = n/2 < 32 ? n/2 : 32;
+	for (int i = 0; i < layers; i++) {
+		double z = 10.0 - 0.2*i;
+		coord bl = coord_create(-0.5*z, -0.28*z, z, 0.0);
+		coord br = coord_create(0.5*z, -0.28*z, z + 0.01, 0.0);
+		coord tl = coord_create(-0.5*z, 0.28*z, z + 0.01, 0.0);
+		coord tr = coord_create(0.5*z, 0.28*z, z + 0.02, 0.0);
+		out[2*i].a = bl;
+		out[2*i].b = br;
+		out[2*i].c = tr;
+		out[2*i + 1].a = tr;
+		out[2*i + 1].b = tl;
+		out[2*i + 1].c = bl;
+	}
+	return 2*layers;
+}
+
+//a uv sphere of about n triangles
+int bench_sphere(raw_triangle * out, int n) {
+	int rings = (int)sqrt(n/4.0);
+	rings = rings < 3 ? 3 : rings;
+	int segments = 2*rings;
+	double radius = 0.5;
+	double centre = 2.0;
+	int count = 0;
+
+	for (int r = 0; r < rings; r++) {
+		double theta0 = M_PI*r/rings;
+		double theta1 = M_PI*(r + 1)/rings;
+		for (int k = 0; k < segments; k++) {
+			double phi0 = 2*M_PI*k/segments;
+			double phi1 = 2*M_PI*(k + 1)/segments;
+			coord a = coord_create(radius*sin(theta0)*cos(phi0), radius*cos(theta0), centre + radius*sin(theta0)*sin(phi0), 0.0);
+			coord b = coord_create(radius*sin(theta0)*cos(phi1), radius*cos(theta0), centre + radius*sin(theta0)*sin(phi1), 0.0);
+			coord c = coord_create(radius*sin(theta1)*cos(phi0), radius*cos(theta1), centre + radius*sin(theta1)*sin(phi0), 0.0);
+			coord d = coord_create(radius*sin(theta1)*cos(phi1), radius*cos(theta1), centre + radius*sin(theta1)*sin(phi1), 0.0);
+			if (r != 0 && count < n) {
+				out[count].a = a;
+				out[count].b = b;
+				out[count].c = c;
+				count++;
+			}
+			if (r != rings - 1 && count < n) {
+				out[count].a = b;
+				out[count].b = d;
+				out[count].c = c;
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+typedef struct bench_workload {
+	const char * name;
+	int (*generate)(raw_triangle * out, int n);
+} bench_workload;
+
+const bench_workload bench_workloads[] = {
+	{"random", bench_random_triangles},
+	{"large", bench_large_triangles},
+	{"tiny", bench_tiny_triangles},
+	{"overdraw", bench_overdraw},
+	{"sphere", bench_sphere},
+};
+
+const char * bench_compiler() {
+#if defined(__clang__)
+	return "clang " __clang_version__;
+#elif defined(__GNUC__)
+	return "gcc " __VERSION__;
+#else
+	return "unknown";
+#endif
+}
+
+//renders each selected workload for n_frames and prints the results as json on stdout
+int run_benchmark(scene s, const char * workload, int n_triangles, int n_frames) {
+	rgb_color red = {244, 23, 43};
+	rgb_color background = {0, 0, 0};
+	int n_workloads = sizeof(bench_workloads)/sizeof(bench_workloads[0]);
+
+	raw_triangle * raw = malloc(n_triangles*sizeof(raw_triangle));
+	unsigned char * rgb = malloc(3*s.screen_width*s.screen_height);
+	frame_stats stats;
+	s.stats = &stats;
+	//the generated triangles face either way at random
+	s.cull = cull_none;
+
+	const char * shading_names[] = {"vertex", "pixel", "deferred"};
+	printf("{\"compiler\": \"%s\", \"depth\": \"%s\", \"shading\": \"%s\", \"lights\": %d, \"samples\": %d, \"threads\": %d, \"width\": %d, \"height\": %d, \"frames\": %d, \"workloads\": [",
+		bench_compiler(), depth_format, shading_names[s.lights->shading], s.lights->n_lights, s.samples, s.n_threads, s.screen_width, s.screen_height, n_frames);
+
+	int printed = 0;
+	for (int w = 0; w < n_workloads; w++) {
+		if (strcmp(workload, "all") != 0 && strcmp(workload, bench_workloads[w].name) != 0) {
+			continue;
+		}
+
+		bench_random_state = 12345;
+		int count = bench_workloads[w].generate(raw, n_triangles);
+
+		//one untimed frame to warm caches and grow the arenas to their high water mark
+		scene_begin_frame(s);
+		clear_scene(&s, background);
+		draw_raw_triangles(s, raw, count, red);
+		scene_end_frame(&s);
+
+		memset(&stats, 0, sizeof(stats));
+		double start = omp_get_wtime();
+		for (int frame = 0; frame < n_frames; frame++) {
+			scene_begin_frame(s);
+			clear_scene(&s, background);
+			draw_raw_triangles(s, raw, count, red);
+			scene_end_frame(&s);
+			present_rgb(s, rgb);
+		}
+		double seconds = omp_get_wtime() - start;
+		double ns_per_frame = 1e9/n_frames;
+
+		printf("%s\n  {\"name\": \"%s\", \"triangles\": %d, \"seconds\": %f, \"frames_per_second\": %f, "
+			"\"triangles_per_second\": %f, \"pixels_per_second\": %f, "
+			"\"ns_per_frame\": {\"clear\": %.0f, \"transform\": %.0f, \"lighting\": %.0f, \"setup\": %.0f, \"fill\": %.0f, \"resolve\": %.0f, \"present\": %.0f}}",
+			printed ? "," : "", bench_workloads[w].name, count, seconds, n_frames/seconds,
+			stats.triangles/seconds, stats.pixels/seconds,
+			stats.clear*ns_per_frame, stats.transform*ns_per_frame, stats.lighting*ns_per_frame,
+			stats.setup*ns_per_frame, stats.fill*ns_per_frame, stats.resolve*ns_per_frame, stats.present*ns_per_frame);
+		printed++;
+	}
+	printf("\n]}\n");
+
+	free(rgb);
+	free(raw);
+	if (!printed) {
+		fprintf(stderr, "Unknown workload %s\n", workload);
+		return -1;
+	}
+	return 0;
+}
+
+//rasterizer checks, run with --check. the coverage cases draw canvas space triangles
+//that tile a polygon without overlapping: a pixel whose centre is strictly inside the
+//polygon must be covered exactly once, one strictly outside not at all, and one on the
+//outline at most once. then whole scenes are drawn with the fast fill paths and compared
+//with the plain scalar kernels drawing every pixel
+
+#define max_check_triangles 8192
+#define max_check_outline 256
+
+//the cases work in canvas units, sixteenths of a pixel, so corners can fall between pixels
+triangle check_triangle(canvas_point a, canvas_point b, canvas_point c) {
+	rgb_color white = {255, 255, 255};
+	triangle t = {.p1 = a, .p2 = b, .p3 = c, .color = white};
+	return t;
+}
+
+canvas_point check_point(long long x, long long y) {
+	return create_point((int)x, (int)y, 1.0);
+}
+
+//where the point (x, y) on the canvas lies against the polygon: 1 strictly inside, 0 on
+//the outline and -1 outside
+int polygon_side(const canvas_point * polygon, int n, long long x, long long y) {
+	int inside = 0;
+	for (int i = 0, j = n - 1; i < n; j = i++) {
+		long long xi = polygon[i].x;
+		long long yi = polygon[i].y;
+		long long xj = polygon[j].x;
+		long long yj = polygon[j].y;
+		long long cross = (xj - xi)*(y - yi) - (yj - yi)*(x - xi);
+		if (cross == 0 && (x - xi)*(x - xj) <= 0 && (y - yi)*(y - yj) <= 0) {
+			return 0;
+		}
+		if ((yi > y) != (yj > y) && (cross > 0) == (yj > yi)) {
+			inside = !inside;
+		}
+	}
+	return inside ? 1 : -1;
+}
+
+//a fan of 97 triangles with irregular angles around a point, all corners off the pixel grid
+int check_fan(scene s, triangle * out, canvas_point * outline, int * n_outline) {
+	int n = 97;
+	//big enough that snapping the corners cannot put them out of order
+	double radius = 0.45*(s.screen_width < s.screen_height ? s.screen_width : s.screen_height);
+	radius = radius < 200 ? 200 : radius;
+	for (int i = 0; i < n; i++) {
+		double angle = 2*M_PI*(i + bench_random(-0.4, 0.4))/n;
+		outline[i] = check_point(canvas_snap(radius*cos(angle)), canvas_snap(radius*sin(angle)));
+	}
+	canvas_point centre = check_point(canvas_snap(7.3), canvas_snap(-2.7));
+	for (int i = 0; i < n; i++) {
+		out[i] = check_triangle(centre, outline[i], outline[(i + 1) % n]);
+	}
+	*n_outline = n;
+	return n;
+}
+
+//a grid of quads with jittered inner corners, split along alternating diagonals and with
+//every other triangle wound the other way
+int check_grid(scene s, triangle * out, canvas_point * outline, int * n_outline) {
+	enum {columns = 32, rows = 24};
+	int cell = (s.screen_width < s.screen_height ? s.screen_width : s.screen_height)/(rows + 2);
+	cell = (cell < 4 ? 4 : cell)*subpixel_scale;
+	int x0 = -columns*cell/2;
+	int y0 = -rows*cell/2;
+	canvas_point corners[(rows + 1)*(columns + 1)];
+	for (int j = 0; j <= rows; j++) {
+		for (int i = 0; i <= columns; i++) {
+			int jitter = i > 0 && i < columns && j > 0 && j < rows;
+			int dx = jitter ? (int)bench_random(-cell/3, cell/3) : 0;
+			int dy = jitter ? (int)bench_random(-cell/3, cell/3) : 0;
+			corners[j*(columns + 1) + i] = check_point(x0 + i*cell + dx, y0 + j*cell + dy);
+		}
+	}
+	int count = 0;
+	for (int j = 0; j < rows; j++) {
+		for (int i = 0; i < columns; i++) {
+			canvas_point a = corners[j*(columns + 1) + i];
+			canvas_point b = corners[j*(columns + 1) + i + 1];
+			canvas_point c = corners[(j + 1)*(columns + 1) + i + 1];
+			canvas_point d = corners[(j + 1)*(columns + 1) + i];
+			if ((i + j) % 2) {
+				out[count++] = check_triangle(a, b, c);
+				out[count++] = check_triangle(d, c, a);
+			} else {
+				out[count++] = check_triangle(a, b, d);
+				out[count++] = check_triangle(b, d, c);
+			}
+		}
+	}
+	outline[0] = check_point(x0, y0);
+	outline[1] = check_point(x0 + columns*cell, y0);
+	outline[2] = check_point(x0 + columns*cell, y0 + rows*cell);
+	outline[3] = check_point(x0, y0 + rows*cell);
+	*n_outline = 4;
+	return count;
+}
+
+//slivers far thinner than a pixel: a fan from a point well off the screen to a column of
+//points a quarter of a pixel apart
+int check_slivers(scene s, triangle * out, canvas_point * outline, int * n_outline) {
+	int half = ((s.screen_height < s.screen_width ? s.screen_height : s.screen_width)/2 - 4)*subpixel_scale;
+	int step = subpixel_scale/4;
+	canvas_point apex = check_point(-(s.screen_width/2 + 3000)*subpixel_scale + 3, -half/3);
+	int count = 0;
+	for (int y = -half; y < half && count < max_check_triangles; y += step) {
+		out[count++] = check_triangle(apex, check_point(half, y), check_point(half, y + step));
+	}
+	outline[0] = apex;
+	outline[1] = check_point(half, -half);
+	outline[2] = check_point(half, -half + count*step);
+	*n_outline = 3;
+	return count;
+}
+
+//triangles reaching far off the screen, past where the wide kernel's 32 bit edge
+//functions hold: two covering the whole screen between them, and others wholly off it
+int check_offscreen(scene s, triangle * out, canvas_point * outline, int * n_outline) {
+	long long far = 60000*subpixel_scale;
+	outline[0] = check_point(-far, -far/2);
+	outline[1] = check_point(far/2, -far);
+	outline[2] = check_point(far, far/3);
+	outline[3] = check_point(-far/3, far);
+	*n_outline = 4;
+	int count = 0;
+	out[count++] = check_triangle(outline[0], outline[1], outline[2]);
+	out[count++] = check_triangle(outline[2], outline[3], outline[0]);
+
+	//the edges of the screen, half a pixel beyond the outermost pixel centres
+	long long left = -(s.screen_width/2)*subpixel_scale;
+	long long right = (s.screen_width - s.screen_width/2)*subpixel_scale;
+	long long bottom = -(s.screen_height/2)*subpixel_scale;
+	long long top = (s.screen_height - s.screen_height/2)*subpixel_scale;
+	out[count++] = check_triangle(check_point(right, bottom), check_point(right + 500, top), check_point(right + 9000*subpixel_scale, 0));
+	out[count++] = check_triangle(check_point(left, -far), check_point(-far, 0), check_point(left, far));
+	out[count++] = check_triangle(check_point(-far, top), check_point(far, top), check_point(0, far));
+	out[count++] = check_triangle(check_point(-far, bottom), check_point(0, bottom - far), check_point(far, bottom));
+	return count;
+}
+
+typedef struct coverage_case {
+	const char * name;
+	int (*generate)(scene s, triangle * out, canvas_point * outline, int * n_outline);
+} coverage_case;
+
+const coverage_case coverage_cases[] = {
+	{"shared edge fan", check_fan},
+	{"jittered grid", check_grid},
+	{"sub-pixel slivers", check_slivers},
+	{"off-screen triangles", check_offscreen},
+};
+
+//counts the pixels of the coverage buffer breaking the rules, printing the first of each
+//kind. multisampled, each sample is held to them at its own position
+int check_coverage(scene s, const char * name, const canvas_point * outline, int n_outline) {
+	const char * kinds[3] = {"covered twice", "inside left uncovered", "outside covered"};
+	long long counts[3] = {0, 0, 0};
+	int first[3][2];
+	const int (*offsets)[2] = sample_offsets(s.samples);
+	for (int y = 0; y < s.screen_height; y++) {
+		for (int x = 0; x < s.screen_width; x++) {
+			for (int k = 0; k < s.samples; k++) {
+				unsigned int covered = s.coverage[((size_t)y*s.screen_width + x)*s.samples + k];
+				long long sx = (long long)(x - s.screen_width/2)*subpixel_scale + subpixel_scale/2 + offsets[k][0]*(subpixel_scale/sample_unit);
+				long long sy = (long long)(y - s.screen_height/2)*subpixel_scale + subpixel_scale/2 + offsets[k][1]*(subpixel_scale/sample_unit);
+				int side = polygon_side(outline, n_outline, sx, sy);
+				int kind = covered > 1 ? 0 : side > 0 && covered == 0 ? 1 : side < 0 && covered > 0 ? 2 : -1;
+				if (kind >= 0 && counts[kind]++ == 0) {
+					first[kind][0] = x;
+					first[kind][1] = y;
+				}
+			}
+		}
+	}
+	int failed = counts[0] || counts[1] || counts[2];
+	printf("%-24s %s\n", name, failed ? "FAILED" : "ok");
+	for (int k = 0; k < 3; k++) {
+		if (counts[k]) {
+			printf("  %lld %s %s, the first at %d,%d\n", counts[k], s.samples > 1 ? "samples" : "pixels", kinds[k], first[k][0], first[k][1]);
+		}
+	}
+	return failed;
+}
+
+//a floor running from behind the camera into the distance, so its triangles are cut at
+//the near plane. its far edge is level, so every row is covered once across the screen
+//up to the horizon and not at all above
+int check_floor(scene s) {
+	enum {n = 16};
+	raw_triangle raw[2*n*n];
+	for (int j = 0; j < n; j++) {
+		for (int i = 0; i < n; i++) {
+			double x0 = -40.0 + 80.0*i/n;
+			double x1 = -40.0 + 80.0*(i + 1)/n;
+			double z0 = -2.0 + 42.0*j/n;
+			double z1 = -2.0 + 42.0*(j + 1)/n;
+			raw_triangle a = {coord_create(x0, -0.3, z0, 1.0), coord_create(x1, -0.3, z0, 1.0), coord_create(x1, -0.3, z1, 1.0)};
+			raw_triangle b = {coord_create(x1, -0.3, z1, 1.0), coord_create(x0, -0.3, z1, 1.0), coord_create(x0, -0.3, z0, 1.0)};
+			raw[2*(j*n + i)] = a;
+			raw[2*(j*n + i) + 1] = b;
+		}
+	}
+	rgb_color white = {255, 255, 255};
+	s.cull = cull_none;
+	s.samples = 1;
+	draw_raw_triangles(s, raw, 2*n*n, white);
+
+	long long twice = 0;
+	int broken_row = -1;
+	int top = -1;
+	for (int y = 0; y < s.screen_height; y++) {
+		int row_count = 0;
+		for (int x = 0; x < s.screen_width; x++) {
+			unsigned int covered = s.coverage[y*s.screen_width + x];
+			twice += covered > 1;
+			row_count += covered > 0;
+		}
+		if (row_count == s.screen_width && top == y - 1) {
+			top = y;
+		} else if (row_count != 0 && broken_row < 0) {
+			broken_row = y;
+		}
+	}
+	int failed = twice || broken_row >= 0 || (top < 0 && s.screen_height > 1);
+	printf("%-24s %s\n", "near plane floor", failed ? "FAILED" : "ok");
+	if (twice) {
+		printf("  %lld pixels covered twice\n", twice);
+	}
+	if (broken_row >= 0) {
+		printf("  row %d partly covered\n", broken_row);
+	}
+	return failed;
+}
+
+//the still scenes --scene draws, each compared with its image in golden/ by make check.
+//past the pyramid and the cube they are the coverage cases, in the same order
+const char * still_scenes[] = {"pyramid", "cube", "fan", "grid", "slivers", "offscreen"};
+#define n_still_scenes (int)(sizeof(still_scenes)/sizeof(still_scenes[0]))
+
+//draws still scene i into a frame already begun. the coverage cases' triangles are unlit
+//and alternate between two colours, so that a pixel changing hands between them shows
+void draw_still_scene(scene s, int i) {
+	if (i == 0) {
+		pyramid(s, matrix_identity());
+	} else if (i == 1) {
+		coord centre = coord_create(0.0, 0.0, 2.25, 1.0);
+		matrix turn = matrix_matrix_mul(matrix_rotate_x(0.4), matrix_rotate_y(0.6));
+		matrix model = matrix_matrix_mul(matrix_translate(centre.x, centre.y, centre.z), matrix_matrix_mul(turn, matrix_translate(-centre.x, -centre.y, -centre.z)));
+		tirangle_cube(s, model);
+	} else {
+		rgb_color colors[2] = {{244, 23, 43}, {23, 43, 243}};
+		triangle * triangles = malloc(max_check_triangles*sizeof(triangle));
+		canvas_point outline[max_check_outline];
+		int n_outline = 0;
+		bench_random_state = 12345;
+		int n = coverage_cases[i - 2].generate(s, triangles, outline, &n_outline);
+		assert(n <= max_check_triangles && n_outline <= max_check_outline);
+		for (int k = 0; k < n; k++) {
+			triangles[k].color = colors[k % 2];
+			triangles[k].p1l = triangles[k].p2l = triangles[k].p3l = color_max - 1;
+		}
+		draw_triangles(s, triangles, n);
+		free(triangles);
+	}
+}
+
+//draws whole scene i of the catalog, returning its name
+const char * draw_check_scene(scene s, int i, raw_triangle * raw) {
+	rgb_color red = {244, 23, 43};
+	rgb_color background = {0, 0, 0};
+	scene_begin_frame(s);
+	clear_scene(&s, background);
+	const char * name = NULL;
+	if (i < 2) {
+		draw_still_scene(s, i);
+		name = i == 0 ? "pyramid" : "tirangle_cube";
+	} else {
+		bench_random_state = 12345;
+		int count = bench_workloads[i - 2].generate(raw, 2000);
+		s.cull = cull_none;
+		draw_raw_triangles(s, raw, count, red);
+		name = bench_workloads[i - 2].name;
+	}
+	scene_end_frame(&s);
+	return name;
+}
+
+//runs every check on s, printing a line for each. returns the number that failed
+int run_checks(scene s) {
+	int failures = 0;
+	triangle * triangles = malloc(max_check_triangles*sizeof(triangle));
+	canvas_point outline[max_check_outline];
+	size_t n_pixels = (size_t)s.screen_width*s.screen_height;
+	size_t n_samples = n_pixels*s.samples;
+	s.coverage = calloc(n_samples, sizeof(unsigned int));
+	s.stats = NULL;
+
+	int n_cases = sizeof(coverage_cases)/sizeof(coverage_cases[0]);
+	for (int c = 0; c <= n_cases; c++) {
+		memset(s.coverage, 0, n_samples*sizeof(unsigned int));
+		scene_begin_frame(s);
+		bench_random_state = 12345;
+		if (c == n_cases) {
+			failures += check_floor(s);
+			continue;
+		}
+		int n_outline = 0;
+		int n = coverage_cases[c].generate(s, triangles, outline, &n_outline);
+		assert(n <= max_check_triangles && n_outline <= max_check_outline);
+		draw_triangles(s, triangles, n);
+		failures += check_coverage(s, coverage_cases[c].name, outline, n_outline);
+	}
+	free(s.coverage);
+	s.coverage = NULL;
+	free(triangles);
+
+	//the fast paths are the wide kernel, which steps 1/z and the intensity in single
+	//precision, and the coarse depth rejection. colours may move by a step where the
+	//intensity rounds the other way, and further only where the depth test was a near tie
+	//between two surfaces, which shows as the depths agreeing to single precision.
+	//multisampled scenes are compared sample by sample, before the resolve averages them
+	unsigned int * colors = s.samples > 1 ? s.sample_color : s.screen;
+	depth_value * depths = s.samples > 1 ? s.sample_depth : s.depth_buffer;
+	unsigned int * reference = malloc(n_samples*sizeof(unsigned int));
+	depth_value * reference_depth = malloc(n_samples*sizeof(depth_value));
+	raw_triangle * raw = malloc(2000*sizeof(raw_triangle));
+	int n_scenes = 2 + sizeof(bench_workloads)/sizeof(bench_workloads[0]);
+	for (int i = 0; i < n_scenes; i++) {
+		s.reference_fill = 1;
+		draw_check_scene(s, i, raw);
+		memcpy(reference, colors, n_samples*sizeof(unsigned int));
+		memcpy(reference_depth, depths, n_samples*sizeof(depth_value));
+		s.reference_fill = 0;
+		const char * name = draw_check_scene(s, i, raw);
+
+		long long differing = 0;
+		long long ties = 0;
+		int largest = 0;
+		int first = -1;
+		for (size_t p = 0; p < n_samples; p++) {
+			const unsigned char * a = (const unsigned char *)&reference[p];
+			const unsigned char * b = (const unsigned char *)&colors[p];
+			int worst = 0;
+			for (int k = 0; k < 3; k++) {
+				int d = abs(a[k] - b[k]);
+				worst = d > worst ? d : worst;
+			}
+			if (worst <= 1) {
+				continue;
+			}
+			double wa = depth_decode(reference_depth[p]);
+			double wb = depth_decode(depths[p]);
+			double tie = 1e-5*fmax(wa, wb);
+#ifdef DEPTH_FIXED24
+			//or a couple of steps of the stored depth, which are coarser far away
+			tie += 2/depth_fixed_scale;
+#endif
+			if (fabs(wa - wb) <= tie) {
+				ties++;
+				continue;
+			}
+			differing++;
+			first = first < 0 ? (int)(p/s.samples) : first;
+			largest = worst > largest ? worst : largest;
+		}
+		char label[64];
+		snprintf(label, sizeof(label), "%s fast fill", name);
+		printf("%-24s %s", label, differing ? "FAILED" : "ok");
+		if (ties) {
+			printf(", %lld depth ties resolved the other way", ties);
+		}
+		printf("\n");
+		if (differing) {
+			printf("  %lld %s differ from the reference fill, by up to %d, the first at %d,%d\n", differing, s.samples > 1 ? "samples" : "pixels", largest, first % s.screen_width, first / s.screen_width);
+			failures++;
+		}
+	}
+	free(raw);
+	free(reference_depth);
+	free(reference);
+	return failures;
+}
+
+//where finished frames go. present is handed a scene whose screen is the front buffer
+//and returns 0 to carry on, 1 to stop and -1 on failure. it runs on the main thread
+//while the next frame renders, so it must not touch the scene's other buffers
+typedef struct presenter {
+	int (*present)(struct presenter * p, scene front, int frame);
+	void * data;
+} presenter;
+
+//drops every frame, so the double buffered loop can be run and timed without a window
+int null_present(presenter * p, scene front, int frame) {
+	(void)p;
+	(void)front;
+	(void)frame;
+	return 0;
+}
+
+typedef struct file_presenter {
+	const char * path;
+	int tag_size;
+} file_presenter;
+
+int file_present(presenter * p, scene front, int frame) {
+	file_presenter * f = p->data;
+	return write_frame(front, f->path, frame, f->tag_size) == 0 ? 0 : -1;
+}
 
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, texture);
+//checks frames against stored reference images instead of writing them, the reference
+//for each frame named as file_presenter would name it. a frame differing in more than
+//the tolerance on any channel of any pixel is reported and counted, and the run goes on
+typedef struct compare_presenter {
+	const char * path;
+	int tag_size;
+	int tolerance;
+	int failures;
+} compare_presenter;
+
+int compare_present(presenter * p, scene front, int frame) {
+	compare_presenter * c = p->data;
+	char name[4096];
+	if (frame_name(name, sizeof(name), front, c->path, frame, c->tag_size) != 0) {
+		return -1;
+	}
+	int width, height;
+	unsigned char * reference = ppm_read(name, &width, &height);
+	if (!reference) {
+		return -1;
+	}
+	if (width != front.screen_width || height != front.screen_height) {
+		fprintf(stderr, "%s is %dx%d, the frame %dx%d\n", name, width, height, front.screen_width, front.screen_height);
+		free(reference);
+		c->failures++;
+		return 0;
+	}
+
+	unsigned char * rgb = malloc(3*(size_t)width);
+	long long differing = 0;
+	int largest = 0;
+	for (int y = 0; y < height; y++) {
+		screen_row_rgb(front, height - 1 - y, rgb);
+		const unsigned char * row = &reference[3*(size_t)y*width];
+		for (int x = 0; x < width; x++) {
+			int worst = 0;
+			for (int k = 0; k < 3; k++) {
+				int d = abs(rgb[3*x + k] - row[3*x + k]);
+				worst = d > worst ? d : worst;
+			}
+			differing += worst > c->tolerance;
+			largest = worst > largest ? worst : largest;
+		}
+	}
+	free(rgb);
+	free(reference);
+	if (differing) {
+		fprintf(stderr, "%s: %lld pixels differ by more than %d, by up to %d\n", name, differing, c->tolerance, largest);
+		c->failures++;
+	}
+	return 0;
+}
+
+#ifndef HEADLESS
+//streams frames into the texture through two pixel buffers, so the copy into one can
+//overlap the upload from the other. with ARB_buffer_storage they stay mapped for good
+//and a fence per buffer says when the gpu has finished reading it
+typedef struct gl_presenter {
+	GLFWwindow * window;
+	unsigned int VAO;
+	unsigned int program;
+	unsigned int texture;
+	unsigned int pbo[2];
+	void * mapped[2];
+	GLsync fence[2];
+	int next;
+	size_t bytes;
+} gl_presenter;
+
+void gl_presenter_init(gl_presenter * g, int width, int height) {
+	g->window = opengl_init(width, height, &g->VAO, &g->program, &g->texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	g->bytes = (size_t)width*height*sizeof(unsigned int);
+	g->next = 0;
+	int persistent = GLEW_ARB_buffer_storage;
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(2, g->pbo);
+	for (int i = 0; i < 2; i++) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g->pbo[i]);
+		g->mapped[i] = NULL;
+		g->fence[i] = NULL;
+		if (persistent) {
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, g->bytes, NULL, flags);
+			g->mapped[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, g->bytes, flags);
+		} else {
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, g->bytes, NULL, GL_STREAM_DRAW);
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
 
-		glBindVertexArray(VAO);
-		glUseProgram(program);
-		glDrawArrays(GL_TRIANGLES, 0, 6);
+int gl_present(presenter * p, scene front, int frame) {
+	(void)frame;
+	gl_presenter * g = p->data;
+	handle_close(g->window);
+	if (glfwWindowShouldClose(g->window)) {
+		return 1;
+	}
 
-		glfwSwapBuffers(window);
-		glfwPollEvents();
-			
-		i++;
-		if (i > 1000) {
-			exit(0);
+	int i = g->next;
+	g->next ^= 1;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g->pbo[i]);
+	if (g->mapped[i]) {
+		if (g->fence[i]) {
+			glClientWaitSync(g->fence[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			glDeleteSync(g->fence[i]);
+			g->fence[i] = NULL;
 		}
+		memcpy(g->mapped[i], front.screen, g->bytes);
+	} else {
+		//orphan the old storage rather than wait for the gpu to finish with it
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, g->bytes, NULL, GL_STREAM_DRAW);
+		void * pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, g->bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (!pixels) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			return -1;
+		}
+		memcpy(pixels, front.screen, g->bytes);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
 
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, g->texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, front.screen_width, front.screen_height, GL_RGBA, GL_UNSIGNED_BYTE, (void *)0);
+	if (g->mapped[i]) {
+		g->fence[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	glClearColor(0.3, 0.6, 1.0, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glBindVertexArray(g->VAO);
+	glUseProgram(g->program);
+	glDrawArrays(GL_TRIANGLES, 0, 6);
+
+	glfwSwapBuffers(g->window);
+	glfwPollEvents();
+	return 0;
+}
 
+void gl_presenter_free(gl_presenter * g) {
+	for (int i = 0; i < 2; i++) {
+		if (g->fence[i]) {
+			glDeleteSync(g->fence[i]);
+		}
+		if (g->mapped[i]) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g->pbo[i]);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glDeleteBuffers(2, g->pbo);
 	glfwTerminate();
-	int_arena_free(new_scene.scene_arena);
-	free(new_scene.screen);
-	free(new_scene.depth_buffer);
+}
+#endif
+
+//where the demo places its object: the loaded mesh fitted into view if there is one,
+//otherwise the pyramid, turned about its centre by angle radians
+matrix demo_model(mesh * m, matrix fit, double angle) {
+	coord centre = m ? coord_create(0.0, 0.0, 2.0, 1.0) : coord_create(0.0, -0.125, 2.15, 1.0);
+	matrix spin = matrix_matrix_mul(matrix_translate(centre.x, centre.y, centre.z), matrix_matrix_mul(matrix_rotate_y(angle), matrix_translate(-centre.x, -centre.y, -centre.z)));
+	return m ? matrix_matrix_mul(spin, fit) : spin;
+}
+
+//a city of n by n blocks a unit apart, each holding the mesh stretched to a 0.6 wide
+//footprint and a random height
+world * city_create(mesh * m, int n) {
+	world * w = world_create();
+	coord extent = coord_sub(m->high, m->low);
+	extent = coord_create(fmax(extent.x, 1e-6), fmax(extent.y, 1e-6), fmax(extent.z, 1e-6), 0.0);
+	matrix centre = matrix_translate(-0.5*(m->low.x + m->high.x), -0.5*(m->low.y + m->high.y), -0.5*(m->low.z + m->high.z));
+	unsigned int state = 12345;
+	for (int z = 0; z < n; z++) {
+		for (int x = 0; x < n; x++) {
+			state = state*1664525 + 1013904223;
+			double height = 0.5 + 2.5*((state >> 8)/16777216.0);
+			rgb_color color = {(unsigned char)(140 + (state & 63)), (unsigned char)(120 + ((state >> 6) & 63)), (unsigned char)(100 + ((state >> 12) & 63))};
+			matrix footprint = matrix_matrix_mul(matrix_translate(x, 0.5*height, z), matrix_scaling(0.6/extent.x, height/extent.y, 0.6/extent.z));
+			world_add(w, m, matrix_matrix_mul(footprint, centre), color);
+		}
+	}
+	world_build(w);
+	return w;
+}
+
+//looks along the streets of a city from the middle of it at street level, turned by angle
+void draw_city(scene s, world * city, double angle) {
+	coord low = city->nodes[0].low;
+	coord high = city->nodes[0].high;
+	coord eye = coord_create(floor(0.5*(low.x + high.x)) + 0.5, 0.4, floor(0.5*(low.z + high.z)) + 0.5, 1.0);
+	coord target = coord_add(eye, coord_create(sin(angle), 0.0, cos(angle), 0.0));
+	s.view = matrix_look_at(eye, target, coord_create(0.0, 1.0, 0.0, 0.0));
+	draw_world(s, city);
+}
+
+//what main draws each frame: the still scene if one was picked, the city if there is one,
+//the loaded mesh or else the pyramid
+void draw_demo(scene s, int still, mesh * m, world * city, matrix fit, double angle) {
+	if (still >= 0) {
+		draw_still_scene(s, still);
+	} else if (city) {
+		draw_city(s, city, angle);
+	} else if (m) {
+		rgb_color red = {244, 23, 43};
+		draw_mesh(s, m, demo_model(m, fit, angle), red);
+	} else {
+		pyramid(s, demo_model(m, fit, angle));
+	}
+}
+
+//what main draws after the frame is lit: the mesh's wireframe when s.wireframe asks for one
+void draw_demo_overlay(scene s, mesh * m, world * city, matrix fit, double angle) {
+	if (m && !city && s.wireframe != wireframe_none) {
+		rgb_color blue = {23, 43, 243};
+		draw_mesh_edges(s, m, demo_model(m, fit, angle), blue, s.wireframe == wireframe_smooth);
+	}
+}
+
+//renders frames on a thread of its own into the back buffer, s.screen, while the main
+//thread presents the front one. requested and rendered count frames, and a negative
+//requested asks the thread to exit
+typedef struct render_worker {
+	scene s;
+	int still;
+	mesh * m;
+	world * city;
+	matrix fit;
+	double spin;
+	rgb_color background;
+	int requested;
+	int rendered;
+	double render_seconds;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} render_worker;
+
+void * render_worker_run(void * argument) {
+	render_worker * w = argument;
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->requested == w->rendered) {
+			pthread_cond_wait(&w->changed, &w->lock);
+		}
+		if (w->requested < 0) {
+			break;
+		}
+		scene s = w->s;
+		int frame = w->rendered;
+		pthread_mutex_unlock(&w->lock);
+
+		double start = omp_get_wtime();
+		scene_begin_frame(s);
+		clear_scene(&s, w->background);
+		draw_demo(s, w->still, w->m, w->city, w->fit, frame*w->spin);
+		scene_end_frame(&s);
+		draw_demo_overlay(s, w->m, w->city, w->fit, frame*w->spin);
+		double seconds = omp_get_wtime() - start;
+
+		pthread_mutex_lock(&w->lock);
+		w->render_seconds += seconds;
+		w->rendered++;
+		pthread_cond_broadcast(&w->changed);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+typedef struct animation_timing {
+	int frames;
+	double render;
+	double present;
+	double total;
+} animation_timing;
+
+//the animated loop. frame n + 1 renders into the back buffer while frame n is presented
+//from the front, then the two swap, so a frame costs about the larger of the two rather
+//than their sum. n_frames of 0 runs until the presenter stops it
+int run_animation(scene s, presenter * p, int still, mesh * m, world * city, matrix fit, double spin, rgb_color background, int n_frames, animation_timing * timing) {
+	size_t buffer_bytes = (((size_t)s.screen_width*s.screen_height*sizeof(unsigned int) + 63)/64)*64;
+	unsigned int * front = aligned_alloc(64, buffer_bytes);
+	render_worker w;
+	w.s = s;
+	w.still = still;
+	w.m = m;
+	w.city = city;
+	w.fit = fit;
+	w.spin = spin;
+	w.background = background;
+	w.requested = 1;
+	w.rendered = 0;
+	w.render_seconds = 0.0;
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.changed, NULL);
+	pthread_t thread;
+	if (!front || pthread_create(&thread, NULL, render_worker_run, &w) != 0) {
+		fprintf(stderr, "Could not start the render thread\n");
+		free(front);
+		return -1;
+	}
+
+	double start = omp_get_wtime();
+	double present_seconds = 0.0;
+	int status = 0;
+	int frame = 0;
+	for (;; frame++) {
+		pthread_mutex_lock(&w.lock);
+		while (w.rendered <= frame) {
+			pthread_cond_wait(&w.changed, &w.lock);
+		}
+		unsigned int * back = front;
+		front = w.s.screen;
+		w.s.screen = back;
+		if (n_frames == 0 || frame + 1 < n_frames) {
+			w.requested = frame + 2;
+			pthread_cond_broadcast(&w.changed);
+		}
+		pthread_mutex_unlock(&w.lock);
+
+		scene shown = s;
+		shown.screen = front;
+		shown.stats = NULL;
+		double present_start = omp_get_wtime();
+		status = p->present(p, shown, frame);
+		present_seconds += omp_get_wtime() - present_start;
+		if (status != 0 || frame + 1 == n_frames) {
+			frame++;
+			break;
+		}
+	}
+
+	//let a frame started before the presenter stopped finish, then shut the thread down
+	pthread_mutex_lock(&w.lock);
+	while (w.rendered < w.requested) {
+		pthread_cond_wait(&w.changed, &w.lock);
+	}
+	w.requested = -1;
+	pthread_cond_broadcast(&w.changed);
+	pthread_mutex_unlock(&w.lock);
+	pthread_join(thread, NULL);
+	pthread_mutex_destroy(&w.lock);
+	pthread_cond_destroy(&w.changed);
+
+	//the caller keeps ownership of s.screen whichever buffer it ended up as
+	free(front == s.screen ? w.s.screen : front);
+	if (timing) {
+		timing->frames = frame;
+		timing->render = w.render_seconds;
+		timing->present = present_seconds;
+		timing->total = omp_get_wtime() - start;
+	}
+	return status < 0 ? -1 : 0;
+}
+
+//reads a whole decimal argument into value. returns -1 unless it is an integer of at least
+//minimum
+int parse_at_least(const char * text, int minimum, int * value) {
+	char * end;
+	errno = 0;
+	long parsed = strtol(text, &end, 10);
+	if (end == text || *end != 0 || errno != 0 || parsed < minimum || parsed > INT_MAX) {
+		return -1;
+	}
+	*value = (int)parsed;
+	return 0;
+}
+
+//parse_at_least for counts, which start at 1
+int parse_positive(const char * text, int * value) {
+	return parse_at_least(text, 1, value);
+}
+
+void print_usage(const char * name) {
+	fprintf(stderr, "usage: %s [-o out.ppm|out.png|out.rgb|-] [--null] [--frames n] [--spin degrees] [--mesh file] [--convert in.obj out.mesh] [--bench workload] [--triangles n] [--size wxh]... [--phong|--deferred] [--light directional|point x,y,z]... [--shininess n] [--texture file.ppm] [--filter nearest|bilinear|trilinear] [--wireframe hard|smooth] [--msaa 4|8] [--city n] [--scene name] [--compare ref.ppm] [--tolerance n] [--check] [--stats]\n", name);
+	fprintf(stderr, "  -o path      render offscreen and write each frame to path, - streams raw rgb to stdout\n");
+	fprintf(stderr, "  --null       render frames through the double buffered loop, drop them and print timings as json\n");
+	fprintf(stderr, "  --frames n   number of frames to render offscreen, path may hold a %%d for the frame number.\n");
+	fprintf(stderr, "               the window runs until closed unless this is given\n");
+	fprintf(stderr, "  --spin d     turn the object by d degrees every frame\n");
+	fprintf(stderr, "  --mesh file  draw an obj or binary mesh instead of the pyramid\n");
+	fprintf(stderr, "  --convert a b  convert the obj or binary mesh a to the binary mesh b and exit\n");
+	fprintf(stderr, "  --bench w    time the workload w (all, random, large, tiny, overdraw, sphere) and print json\n");
+	fprintf(stderr, "  --triangles n  triangles per benchmark workload, 20000 by default\n");
+	fprintf(stderr, "  --size wxh   render at w by h, 1920x1080 by default. repeat to render up to %d scenes\n", max_scenes);
+	fprintf(stderr, "               from the same workload, each file then gets _wxh before its extension\n");
+	fprintf(stderr, "  --phong      light every pixel instead of every vertex\n");
+	fprintf(stderr, "  --deferred   draw colour and normals first, then light each visible pixel once\n");
+	fprintf(stderr, "  --light t v  add a light in view space, up to %d. a directional light shines along v,\n", max_lights);
+	fprintf(stderr, "               a point light sits at v. the default is one light along -0.4,-0.4,1\n");
+	fprintf(stderr, "  --shininess n  specular exponent, 11 by default\n");
+	fprintf(stderr, "  --texture f  texture the mesh with a binary ppm, using the obj's vt coordinates\n");
+	fprintf(stderr, "  --filter f   texture filtering, trilinear by default\n");
+	fprintf(stderr, "  --wireframe w  draw the mesh's edges over it, hard or anti-aliased with smooth\n");
+	fprintf(stderr, "  --msaa n     anti-alias with n samples per pixel, shading each pixel once\n");
+	fprintf(stderr, "  --city n     look around a city of n by n boxes, or of the mesh, culling what is\n");
+	fprintf(stderr, "               out of view or hidden. --null then also prints what the last frame drew\n");
+	fprintf(stderr, "  --scene s    draw the still scene s (pyramid, cube, fan, grid, slivers, offscreen) instead,\n");
+	fprintf(stderr, "               the ones make check compares with the images in golden/\n");
+	fprintf(stderr, "  --compare p  render offscreen and compare each frame with the ppm at p, named like -o,\n");
+	fprintf(stderr, "               exiting with 1 if any differ. references are made by running with -o\n");
+	fprintf(stderr, "  --tolerance n  largest difference per channel --compare lets pass, 0 by default\n");
+	fprintf(stderr, "  --check      check the rasterizer's fill rules and fast paths and print the results\n");
+	fprintf(stderr, "  --stats      print how much of the scene arena was used to stderr on exit\n");
+}
+
+int main(int argc, char ** argv) {	
+	const char * output_path = NULL;
+	const char * compare_path = NULL;
+	int tolerance = 0;
+	int check = 0;
+	int print_stats = 0;
+	const char * bench_name = NULL;
+	int n_frames = 1;
+	int n_frames_set = 0;
+	int bench_triangles = 20000;
+	const char * mesh_path = NULL;
+	double spin = 0.0;
+	int null_output = 0;
+	int n_scenes = 0;
+	light_rig rig;
+	light_rig_init(&rig);
+	int lights_given = 0;
+	const char * texture_path = NULL;
+	int filter = filter_trilinear;
+	int wireframe = wireframe_none;
+	int samples = 1;
+	int city_size = 0;
+	int still = -1;
+	int widths[max_scenes];
+	int heights[max_scenes];
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			output_path = argv[++i];
+		} else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+			compare_path = argv[++i];
+		} else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+			if (parse_at_least(argv[++i], 0, &tolerance) != 0) {
+				fprintf(stderr, "Bad tolerance %s, expected a whole number of at least 0\n", argv[i]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--check") == 0) {
+			check = 1;
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			print_stats = 1;
+		} else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			if (parse_positive(argv[++i], &n_frames) != 0) {
+				fprintf(stderr, "Bad frame count %s, expected a whole number of at least 1\n", argv[i]);
+				return 1;
+			}
+			n_frames_set = 1;
+		} else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+			bench_name = argv[++i];
+		} else if (strcmp(argv[i], "--phong") == 0) {
+			rig.shading = shade_pixel;
+		} else if (strcmp(argv[i], "--deferred") == 0) {
+			rig.shading = shade_deferred;
+		} else if (strcmp(argv[i], "--shininess") == 0 && i + 1 < argc) {
+			int shininess;
+			if (parse_positive(argv[++i], &shininess) != 0) {
+				fprintf(stderr, "Bad shininess %s, expected a whole number of at least 1\n", argv[i]);
+				return 1;
+			}
+			light_rig_set_shininess(&rig, shininess);
+		} else if (strcmp(argv[i], "--light") == 0 && i + 2 < argc) {
+			int type = strcmp(argv[i + 1], "point") == 0 ? light_point : light_directional;
+			double x, y, z;
+			if ((type == light_directional && strcmp(argv[i + 1], "directional") != 0) || sscanf(argv[i + 2], "%lf,%lf,%lf", &x, &y, &z) != 3) {
+				fprintf(stderr, "Bad light %s %s, expected directional|point x,y,z\n", argv[i + 1], argv[i + 2]);
+				return 1;
+			}
+			if (!lights_given) {
+				rig.n_lights = 0;
+				lights_given = 1;
+			}
+			if (light_rig_add(&rig, type, coord_create(x, y, z, 0.0), 1.0) != 0) {
+				fprintf(stderr, "At most %d lights\n", max_lights);
+				return 1;
+			}
+			i += 2;
+		} else if (strcmp(argv[i], "--texture") == 0 && i + 1 < argc) {
+			texture_path = argv[++i];
+		} else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+			i++;
+			const char * filters[] = {"nearest", "bilinear", "trilinear"};
+			filter = -1;
+			for (int k = 0; k < 3; k++) {
+				if (strcmp(argv[i], filters[k]) == 0) {
+					filter = k;
+				}
+			}
+			if (filter < 0) {
+				print_usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--wireframe") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "hard") == 0) {
+				wireframe = wireframe_hard;
+			} else if (strcmp(argv[i], "smooth") == 0) {
+				wireframe = wireframe_smooth;
+			} else {
+				print_usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--msaa") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "4") == 0) {
+				samples = 4;
+			} else if (strcmp(argv[i], "8") == 0) {
+				samples = 8;
+			} else {
+				print_usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--city") == 0 && i + 1 < argc) {
+			if (parse_positive(argv[++i], &city_size) != 0) {
+				fprintf(stderr, "Bad city size %s, expected a whole number of at least 1\n", argv[i]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+			i++;
+			still = -1;
+			for (int k = 0; k < n_still_scenes; k++) {
+				if (strcmp(argv[i], still_scenes[k]) == 0) {
+					still = k;
+				}
+			}
+			if (still < 0) {
+				print_usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--null") == 0) {
+			null_output = 1;
+		} else if (strcmp(argv[i], "--spin") == 0 && i + 1 < argc) {
+			spin = atof(argv[++i])*M_PI/180.0;
+		} else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+			mesh_path = argv[++i];
+		} else if (strcmp(argv[i], "--convert") == 0 && i + 2 < argc) {
+			mesh * m = mesh_load(argv[i + 1]);
+			int result = m ? mesh_save_binary(m, argv[i + 2]) : -1;
+			if (m) {
+				mesh_free(m);
+			}
+			return result == 0 ? 0 : 1;
+		} else if (strcmp(argv[i], "--triangles") == 0 && i + 1 < argc) {
+			if (parse_positive(argv[++i], &bench_triangles) != 0) {
+				fprintf(stderr, "Bad triangle count %s, expected a whole number of at least 1\n", argv[i]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc && n_scenes < max_scenes) {
+			i++;
+			if (sscanf(argv[i], "%dx%d", &widths[n_scenes], &heights[n_scenes]) != 2 || widths[n_scenes] <= 0 || heights[n_scenes] <= 0) {
+				fprintf(stderr, "Bad size %s, expected wxh\n", argv[i]);
+				return 1;
+			}
+			n_scenes++;
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+#ifdef HEADLESS
+	if (!output_path && !compare_path && !check && !bench_name && !null_output) {
+		print_usage(argv[0]);
+		return 1;
+	}
+#endif
+
+	if (n_scenes == 0) {
+		widths[0] = default_width;
+		heights[0] = default_height;
+		n_scenes = 1;
+	}
+	scene scenes[max_scenes];
+	for (int i = 0; i < n_scenes; i++) {
+		scenes[i] = scene_create(widths[i], heights[i]);
+		*scenes[i].lights = rig;
+		scene_set_shading(&scenes[i], rig.shading);
+		scenes[i].wireframe = wireframe;
+		scene_set_samples(&scenes[i], samples);
+	}
+
+	mesh * demo_mesh = NULL;
+	matrix mesh_fit = matrix_identity();
+	if (mesh_path) {
+		demo_mesh = mesh_load(mesh_path);
+		if (!demo_mesh) {
+			return 1;
+		}
+		mesh_fit = mesh_fit_in_view(demo_mesh);
+	}
+	mesh * city_mesh = NULL;
+	world * city = NULL;
+	if (city_size > 0) {
+		city_mesh = demo_mesh ? NULL : mesh_box();
+		city = city_create(demo_mesh ? demo_mesh : city_mesh, city_size);
+	}
+	texture * demo_texture = NULL;
+	if (texture_path) {
+		demo_texture = texture_load_ppm(texture_path);
+		if (!demo_texture) {
+			return 1;
+		}
+		demo_texture->filter = filter;
+		for (int i = 0; i < n_scenes; i++) {
+			scenes[i].texture = demo_texture;
+		}
+	}
+	rgb_color background = {0, 0, 0};
+
+	int status = 0;
+	if (check) {
+		for (int i = 0; i < n_scenes; i++) {
+			printf("%dx%d\n", scenes[i].screen_width, scenes[i].screen_height);
+			status |= run_checks(scenes[i]) != 0;
+		}
+	} else if (bench_name) {
+		status = run_benchmark(scenes[0], bench_name, bench_triangles, n_frames_set ? n_frames : 20);
+	} else if (compare_path) {
+		compare_presenter c = {compare_path, n_scenes > 1, tolerance, 0};
+		presenter p = {compare_present, &c};
+		for (int i = 0; i < n_scenes && status == 0; i++) {
+			status = run_animation(scenes[i], &p, still, demo_mesh, city, mesh_fit, spin, background, n_frames, NULL);
+		}
+		status |= c.failures != 0;
+	} else if (output_path) {
+		file_presenter f = {output_path, n_scenes > 1};
+		presenter p = {file_present, &f};
+		for (int i = 0; i < n_scenes && status == 0; i++) {
+			status = run_animation(scenes[i], &p, still, demo_mesh, city, mesh_fit, spin, background, n_frames, NULL);
+		}
+		fflush(stdout);
+	} else if (null_output) {
+		presenter p = {null_present, NULL};
+		for (int i = 0; i < n_scenes && status == 0; i++) {
+			animation_timing timing;
+			status = run_animation(scenes[i], &p, still, demo_mesh, city, mesh_fit, spin, background, n_frames, &timing);
+			printf("{\"width\": %d, \"height\": %d, \"frames\": %d, \"render_ms\": %.3f, \"present_ms\": %.3f, \"frame_ms\": %.3f",
+				scenes[i].screen_width, scenes[i].screen_height, timing.frames, 1000.0*timing.render/timing.frames,
+				1000.0*timing.present/timing.frames, 1000.0*timing.total/timing.frames);
+			if (city) {
+				printf(", \"instances\": %d, \"drawn\": %d, \"outside\": %d, \"occluded\": %d", city->n_instances, city->drawn, city->outside, city->occluded);
+			}
+			printf("}\n");
+		}
+	} else {
+#ifndef HEADLESS
+		gl_presenter g;
+		gl_presenter_init(&g, scenes[0].screen_width, scenes[0].screen_height);
+		presenter p = {gl_present, &g};
+		status = run_animation(scenes[0], &p, still, demo_mesh, city, mesh_fit, spin, background, n_frames_set ? n_frames : 0, NULL);
+		gl_presenter_free(&g);
+#endif
+	}
+
+	if (city) {
+		world_free(city);
+	}
+	if (city_mesh) {
+		mesh_free(city_mesh);
+	}
+	if (demo_mesh) {
+		mesh_free(demo_mesh);
+	}
+	if (demo_texture) {
+		texture_free(demo_texture);
+	}
+	for (int i = 0; i < n_scenes; i++) {
+		if (print_stats) {
+			scene_print_arena_stats(scenes[i]);
+		}
+		scene_free(&scenes[i]);
+	}
+	return status == 0 ? 0 : 1;
 }